@@ -34,9 +34,40 @@
 #include <errno.h>
 #include <pwd.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "libaudit.h"
 #include "auparse.h"
 
+/* USDT probes, see probes.rst. They cost a nop each when not traced. */
+#ifdef USDT
+#include <sys/sdt.h>
+#define TRACE(name, ...) STAP_PROBEV(audisp_graylog, name, ##__VA_ARGS__)
+#else
+#define TRACE(name, ...) do {} while (0)
+#endif
+
+/* Missing from older libaudit headers */
+#ifndef AUDIT_PROCTITLE
+#define AUDIT_PROCTITLE 1327
+#endif
+
 #define MAX_JSON_MSG_SIZE 4096
 #define MAX_ARG_LEN 2048
 #define MAX_SUMMARY_LEN 256
@@ -45,6 +76,31 @@
 #ifdef REORDER_HACK
 #define NR_LINES_BUFFERED 64
 #endif
+/* process table, see proc_table_*() */
+#define PROC_TABLE_SIZE 4096
+#define PROC_TABLE_BUCKETS 8192 /* must be a power of 2 */
+#define PROC_LINEAGE_DEPTH 8
+#define PROC_LINEAGE_LEN 1024
+#define PROC_EXE_LEN 256
+#define PROC_COMM_LEN 17
+#define INPUT_BUF_SIZE (16*MAX_AUDIT_MESSAGE_LENGTH)
+#define MAX_SYSLOG_BATCH 256
+#define MAX_OUTPUTS 32
+#define SYSLOG_HEADER_LEN 64
+#define ARCHIVE_BUF_SIZE 65536
+#define HTTP_HEADER_SIZE 1024
+#define HTTP_RBUF_SIZE 4096
+#define HTTP_MAX_PIPELINE 16
+/* session table, see session_*() */
+#define SESSION_TABLE_SIZE 1024
+#define SESSION_TABLE_BUCKETS 2048 /* must be a power of 2 */
+#define MAX_SESSION_HISTORY 2560 /* the rest of a session event takes up to ~1100 bytes of MAX_JSON_MSG_SIZE */
+#ifndef SYSLOG_PATH
+#define SYSLOG_PATH "/dev/log"
+#endif
+#ifndef CONFIG_FILE
+#define CONFIG_FILE "/etc/audisp/audisp-graylog.conf"
+#endif
 
 #ifndef PROGRAM_VERSION
 #define PROGRAM_VERSION "1"
@@ -58,12 +114,11 @@
 extern int h_errno;
 
 static volatile int sig_stop = 0;
+static volatile int sig_reload = 0;
 static char *hostname = NULL;
 static auparse_state_t *au = NULL;
 static int machine = -1;
 
-typedef struct { char *val; } msg_t;
-
 /* msg attributes list */
 typedef struct	ll {
 	char value[MAX_ATTR_SIZE];
@@ -75,20 +130,210 @@ struct json_msg_type {
 	char	*summary;
 	char	*hostname;
 	char	*timestamp;
+	time_t	time;
+	unsigned int	milli;
+	unsigned long	serial;
+	const char	*key;	/* audit key, uid and auid are only used for routing */
+	unsigned int	uid;
+	unsigned int	auid;
 	struct	ll *details;
 };
 
+/* identifies an audit event, see the checkpoint */
+typedef struct {
+	time_t time;
+	unsigned int milli;
+	unsigned long serial;
+} event_id_t;
+
+/* msgs to send, serialized once and shared by all the outputs they're routed to */
+typedef struct {
+	char	*val;		/* JSON */
+	size_t	len;
+	char	*gelf;		/* GELF flavor for HTTP outputs, NULL if none of them gets the message */
+	size_t	gelf_len;
+	unsigned long	serial;
+	time_t	time;
+	event_id_t	after;	/* last event handled before the one of this msg, the checkpoint until it is sent */
+	int		refs;
+} msg_t;
+
 /* msgs to send queue/buffer */
 typedef struct lq {
-	char msg[MAX_JSON_MSG_SIZE];
+	msg_t *msg;
 	struct lq *next;
 } queue_t;
 
-struct lq *msg_queue_list;
-unsigned int msg_queue_list_size = 0;
+typedef enum {
+	OUTPUT_SYSLOG,
+	OUTPUT_ARCHIVE,
+	OUTPUT_HTTP,
+	OUTPUT_ANY
+} output_type_t;
+
+/* per output settings, see audisp-graylog.conf */
+struct output_conf {
+	unsigned long	queue_size;
+	int		queue_drop_newest;
+	unsigned long	syslog_batch_size;
+	char	*archive_dir;
+	unsigned long	archive_max_size;
+	unsigned long	archive_rotate_interval;
+	unsigned long	archive_frame_size;
+	unsigned long	archive_flush_interval;
+	unsigned long	archive_sync_frames;
+	unsigned long	archive_compress_level;
+	char	*http_host;
+	char	*http_path;
+	unsigned long	http_port;
+	unsigned long	http_batch_size;
+	unsigned long	http_pipeline;
+	int		http_compress;
+	unsigned long	http_timeout;
+	unsigned long	http_retry_max_backoff;
+};
+
+/* An output and its queue, drained by its own thread (see output_thread_main()) */
+typedef struct output {
+	char	*name;
+	output_type_t	type;
+	unsigned int	id;		/* bit of the output in route_t.outputs */
+	struct output_conf	conf;
+	void	*state;		/* struct slog_state, archive_state or http_state */
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int		started;
+	int		stop;
+	queue_t	*head;
+	queue_t	*tail;
+	unsigned int	size;
+	unsigned long	dropped;
+	int		unsent;		/* the output thread is sending msgs taken off the queue... */
+	event_id_t	unsent_after;	/* ...the oldest of which has this msg_t.after */
+	int		lost;		/* msgs were not sent on stop, the checkpoint stays before them */
+	unsigned int	oldest_seq;	/* seqlock of the two fields below, which are read without o->lock */
+	int		oldest;		/* the output has msgs not sent yet (queued or being sent)... */
+	event_id_t	oldest_after;	/* ...the oldest of which has this msg_t.after */
+	struct output_conf	*pending;	/* settings from a reload, applied by the output thread */
+	struct output	*replaces;	/* reload: the running output this new definition matches */
+	int		kept;		/* reload: this running output is carried over */
+	struct output *next;
+} output_t;
+
+/* route = <output>[,<output>...] [category=a,b] [key=a,b] [uid=min-max] [auid=min-max] */
+typedef struct route {
+	char	*names;
+	unsigned int	outputs;
+	char	*categories;
+	char	*keys;
+	int		have_uid;
+	unsigned int	uid_min;
+	unsigned int	uid_max;
+	int		have_auid;
+	unsigned int	auid_min;
+	unsigned int	auid_max;
+	struct route *next;
+} route_t;
+
+/* plugin configuration, see load_config() and audisp-graylog.conf */
+typedef enum {
+	SESSION_OFF,
+	SESSION_ON,		/* session summaries in addition to the per-event messages */
+	SESSION_ONLY	/* session summaries replace the execve/write messages of tracked sessions */
+} session_mode_t;
+
+struct plugin_conf {
+	int		syslog_output;
+	int		session_tracking;
+	unsigned long	session_idle_timeout;
+	unsigned long	session_history_size;
+	char		*checkpoint_file;
+	unsigned long	checkpoint_sync_interval;
+	int		catchup;
+	char		*catchup_log;
+	output_t	*outputs;
+	unsigned int	nr_outputs;
+	unsigned int	http_outputs;	/* outputs which need GELF */
+	route_t	*routes;
+};
+
+/* the configuration in use, replaced as a whole on reload (see reload_poll()) */
+static struct plugin_conf *config = NULL;
+static const char *config_path = CONFIG_FILE;
+static int config_required = 0;
+
+/* SIGHUP configuration reload, see reload_poll() */
+typedef enum {
+	RELOAD_IDLE,
+	RELOAD_PREPARING,	/* reload_thread loads the new configuration into reload_config */
+	RELOAD_RETIRING		/* reload_thread frees the previous configuration */
+} reload_state_t;
+
+static reload_state_t reload_state = RELOAD_IDLE;
+
+/* process table entries, built from SYSCALL records (see proc_table_update()) */
+typedef struct pe {
+	int pid;
+	int ppid;
+	int auid;
+	int ses;
+	int exited;
+	char exe[PROC_EXE_LEN];
+	char comm[PROC_COMM_LEN];
+	struct pe *hnext;	/* hash bucket chain */
+	struct pe *prev;	/* LRU list, most recently used first */
+	struct pe *next;
+} proc_t;
+
+static proc_t proc_table[PROC_TABLE_SIZE];
+static proc_t *proc_buckets[PROC_TABLE_BUCKETS];
+static proc_t *proc_lru_head = NULL;
+static proc_t *proc_lru_tail = NULL;
+static unsigned int proc_table_used = 0;
+
+/* session table entries, one per login session (ses) being tracked */
+typedef struct se {
+	int ses;
+	int auid;
+	int login_pid;	/* process which logged in (kernel LOGIN record), 0 if not seen */
+	time_t start;
+	time_t last;
+	unsigned long commands;
+	unsigned long writes;
+	unsigned long cwds;
+	unsigned int cwd_hash;	/* of the last cwd, to only record changes */
+	int truncated;
+	size_t len;
+	size_t size;
+	char *history;
+	struct se *hnext;	/* hash bucket chain */
+	struct se *prev;	/* LRU list, most recently active first */
+	struct se *next;
+} session_t;
+
+static session_t session_table[SESSION_TABLE_SIZE];
+static session_t *session_buckets[SESSION_TABLE_BUCKETS];
+static session_t *session_lru_head = NULL;
+static session_t *session_lru_tail = NULL;
+static session_t *session_free = NULL;
+static unsigned int session_table_used = 0;
 
 static void handle_event(auparse_state_t *au,
 		auparse_cb_event_t cb_event_type, void *user_data);
+static void hex_init(void);
+void syslog_json_msg(struct json_msg_type json_msg);
+char *get_username(int uid);
+void session_close_all(void);
+int checkpoint_open(void);
+void checkpoint_close(void);
+int catchup_start(void);
+void catchup_wait(void);
+static void handle_live_event(auparse_state_t *au, auparse_cb_event_t cb_event_type, void *user_data);
+int output_start_all(void);
+void output_stop_all(void);
+void reload_poll(int wait);
+void reload_finish(void);
 
 static void int_handler(int sig)
 {
@@ -104,6 +349,11 @@ static void term_handler(int sig)
 	sig_stop = 1;
 }
 
+static void hup_handler(int sig)
+{
+	sig_reload = 1;
+}
+
 #ifdef REORDER_HACK
 /*
  * Hack to reorder input
@@ -219,13 +469,597 @@ size_t reorder_input_hack(char **sorted_tmp, char *tmp)
 }
 #endif
 
+/*
+ * Configuration file parsing
+ * The file is made of "keyword = value" lines, empty lines and lines starting with # are ignored. Its path is the first
+ * plugin argument (args in graylog.conf), CONFIG_FILE is used if no argument is given. A missing CONFIG_FILE is not an
+ * error, the defaults are used.
+ * Output keywords apply to the output named by their prefix ("name.keyword"), or without prefix to the default output
+ * of their type: "syslog", "archive" or "http". Other outputs are declared with "output = <name> <type>".
+ */
+static int conf_parse_yesno(const char *val, void *dst)
+{
+	if (!strcasecmp(val, "yes"))
+		*(int *)dst = 1;
+	else if (!strcasecmp(val, "no"))
+		*(int *)dst = 0;
+	else
+		return -1;
+	return 0;
+}
+
+static int conf_parse_ulong(const char *val, void *dst)
+{
+	char *end;
+	unsigned long v;
+
+	errno = 0;
+	v = strtoul(val, &end, 10);
+	if (errno || end == val || *end != '\0' || val[0] == '-')
+		return -1;
+	*(unsigned long *)dst = v;
+	return 0;
+}
+
+static int conf_parse_str(const char *val, void *dst)
+{
+	char *v = strdup(val);
+
+	if (!v)
+		return -1;
+	free(*(char **)dst);
+	*(char **)dst = v;
+	return 0;
+}
+
+static int conf_parse_overflow(const char *val, void *dst)
+{
+	if (!strcmp(val, "drop_oldest"))
+		*(int *)dst = 0;
+	else if (!strcmp(val, "drop_newest"))
+		*(int *)dst = 1;
+	else
+		return -1;
+	return 0;
+}
+
+static int conf_parse_session(const char *val, void *dst)
+{
+	if (!strcmp(val, "no"))
+		*(int *)dst = SESSION_OFF;
+	else if (!strcmp(val, "yes"))
+		*(int *)dst = SESSION_ON;
+	else if (!strcmp(val, "only"))
+		*(int *)dst = SESSION_ONLY;
+	else
+		return -1;
+	return 0;
+}
+
+static const struct conf_kw {
+	const char	*name;
+	output_type_t	type;
+	int			(*parser)(const char *val, void *dst);
+	size_t		offset;
+} conf_keywords[] = {
+	{ "queue_size",					OUTPUT_ANY,		conf_parse_ulong,		offsetof(struct output_conf, queue_size) },
+	{ "queue_overflow",				OUTPUT_ANY,		conf_parse_overflow,	offsetof(struct output_conf, queue_drop_newest) },
+	{ "syslog_batch_size",			OUTPUT_SYSLOG,	conf_parse_ulong,		offsetof(struct output_conf, syslog_batch_size) },
+	{ "archive_dir",				OUTPUT_ARCHIVE,	conf_parse_str,			offsetof(struct output_conf, archive_dir) },
+	{ "archive_max_size",			OUTPUT_ARCHIVE,	conf_parse_ulong,		offsetof(struct output_conf, archive_max_size) },
+	{ "archive_rotate_interval",	OUTPUT_ARCHIVE,	conf_parse_ulong,		offsetof(struct output_conf, archive_rotate_interval) },
+	{ "archive_frame_size",			OUTPUT_ARCHIVE,	conf_parse_ulong,		offsetof(struct output_conf, archive_frame_size) },
+	{ "archive_flush_interval",		OUTPUT_ARCHIVE,	conf_parse_ulong,		offsetof(struct output_conf, archive_flush_interval) },
+	{ "archive_sync_frames",		OUTPUT_ARCHIVE,	conf_parse_ulong,		offsetof(struct output_conf, archive_sync_frames) },
+	{ "archive_compress_level",		OUTPUT_ARCHIVE,	conf_parse_ulong,		offsetof(struct output_conf, archive_compress_level) },
+	{ "http_host",					OUTPUT_HTTP,	conf_parse_str,			offsetof(struct output_conf, http_host) },
+	{ "http_path",					OUTPUT_HTTP,	conf_parse_str,			offsetof(struct output_conf, http_path) },
+	{ "http_port",					OUTPUT_HTTP,	conf_parse_ulong,		offsetof(struct output_conf, http_port) },
+	{ "http_batch_size",			OUTPUT_HTTP,	conf_parse_ulong,		offsetof(struct output_conf, http_batch_size) },
+	{ "http_pipeline",				OUTPUT_HTTP,	conf_parse_ulong,		offsetof(struct output_conf, http_pipeline) },
+	{ "http_compress",				OUTPUT_HTTP,	conf_parse_yesno,		offsetof(struct output_conf, http_compress) },
+	{ "http_timeout",				OUTPUT_HTTP,	conf_parse_ulong,		offsetof(struct output_conf, http_timeout) },
+	{ "http_retry_max_backoff",		OUTPUT_HTTP,	conf_parse_ulong,		offsetof(struct output_conf, http_retry_max_backoff) },
+	{ NULL,							OUTPUT_ANY,		NULL,					0 }
+};
+
+/* keywords which are not about outputs, their offset is in struct plugin_conf */
+static const struct conf_kw conf_global_keywords[] = {
+	{ "syslog_output",				OUTPUT_ANY,		conf_parse_yesno,		offsetof(struct plugin_conf, syslog_output) },
+	{ "session_tracking",			OUTPUT_ANY,		conf_parse_session,		offsetof(struct plugin_conf, session_tracking) },
+	{ "session_idle_timeout",		OUTPUT_ANY,		conf_parse_ulong,		offsetof(struct plugin_conf, session_idle_timeout) },
+	{ "session_history_size",		OUTPUT_ANY,		conf_parse_ulong,		offsetof(struct plugin_conf, session_history_size) },
+	{ "checkpoint_file",			OUTPUT_ANY,		conf_parse_str,			offsetof(struct plugin_conf, checkpoint_file) },
+	{ "checkpoint_sync_interval",	OUTPUT_ANY,		conf_parse_ulong,		offsetof(struct plugin_conf, checkpoint_sync_interval) },
+	{ "catchup",					OUTPUT_ANY,		conf_parse_yesno,		offsetof(struct plugin_conf, catchup) },
+	{ "catchup_log",				OUTPUT_ANY,		conf_parse_str,			offsetof(struct plugin_conf, catchup_log) },
+	{ NULL,							OUTPUT_ANY,		NULL,					0 }
+};
+
+/* names of the output types, which are also the names of their default output */
+static const char *output_types[] = { "syslog", "archive", "http" };
+
+/* Strip leading and trailing blanks in place */
+static char *conf_strip(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		end--;
+	*end = '\0';
+	return s;
+}
+
+static output_t *output_find(struct plugin_conf *c, const char *name)
+{
+	output_t *o;
+
+	for (o = c->outputs; o; o = o->next) {
+		if (!strcmp(o->name, name))
+			return o;
+	}
+	return NULL;
+}
+
+/* Allocate an output with the default settings and append it to c->outputs */
+static output_t *output_new(struct plugin_conf *c, const char *name, output_type_t type)
+{
+	output_t *o, **tail;
+
+	o = calloc(1, sizeof(output_t));
+	if (!o)
+		return NULL;
+	o->name = strdup(name);
+	if (!o->name) {
+		free(o);
+		return NULL;
+	}
+	o->type = type;
+	o->conf.queue_size = 10000;
+	o->conf.syslog_batch_size = 64;
+	o->conf.archive_max_size = 256*1024*1024;
+	o->conf.archive_rotate_interval = 86400;
+	o->conf.archive_frame_size = 1024*1024;
+	o->conf.archive_flush_interval = 5;
+	o->conf.archive_sync_frames = 1;
+	o->conf.archive_compress_level = 3;
+	o->conf.http_port = 12201;
+	o->conf.http_batch_size = 100;
+	o->conf.http_pipeline = 4;
+	o->conf.http_timeout = 10;
+	o->conf.http_retry_max_backoff = 30;
+	pthread_mutex_init(&o->lock, NULL);
+	pthread_cond_init(&o->cond, NULL);
+
+	for (tail = &c->outputs; *tail; tail = &(*tail)->next)
+		;
+	*tail = o;
+	return o;
+}
+
+static void output_conf_free(struct output_conf *c)
+{
+	free(c->archive_dir);
+	free(c->http_host);
+	free(c->http_path);
+}
+
+static void output_free(output_t *o)
+{
+	free(o->name);
+	output_conf_free(&o->conf);
+	if (o->pending) {
+		output_conf_free(o->pending);
+		free(o->pending);
+	}
+	pthread_mutex_destroy(&o->lock);
+	pthread_cond_destroy(&o->cond);
+	free(o);
+}
+
+/* Remove o from c->outputs and free it */
+static void output_remove(struct plugin_conf *c, output_t *o)
+{
+	output_t **pp;
+
+	for (pp = &c->outputs; *pp; pp = &(*pp)->next) {
+		if (*pp == o) {
+			*pp = o->next;
+			break;
+		}
+	}
+	output_free(o);
+}
+
+/* Returns 1 if val is in the comma separated list */
+static int list_match(const char *list, const char *val)
+{
+	size_t len;
+	const char *end;
+
+	if (!val)
+		return 0;
+	len = strlen(val);
+	while (*list) {
+		end = strchr(list, ',');
+		if (!end)
+			end = list + strlen(list);
+		if (end - list == len && !strncmp(list, val, len))
+			return 1;
+		list = *end ? end+1 : end;
+	}
+	return 0;
+}
+
+/* Parse "min-max" or "value" */
+static int conf_parse_range(const char *val, unsigned int *min, unsigned int *max)
+{
+	char *end;
+	unsigned long lo, hi;
+
+	errno = 0;
+	lo = strtoul(val, &end, 10);
+	if (errno || end == val || lo > UINT_MAX)
+		return -1;
+	hi = lo;
+	if (*end == '-') {
+		val = end+1;
+		hi = strtoul(val, &end, 10);
+		if (errno || end == val || hi > UINT_MAX || hi < lo)
+			return -1;
+	}
+	if (*end != '\0')
+		return -1;
+	*min = lo;
+	*max = hi;
+	return 0;
+}
+
+/* Parse a route line, output names are resolved by conf_check() once all outputs are known */
+static int conf_parse_route(struct plugin_conf *c, char *val)
+{
+	route_t *r, **tail;
+	char *tok, *saved;
+	int rc = 0;
+
+	r = calloc(1, sizeof(route_t));
+	if (!r)
+		return -1;
+
+	for (tok = strtok_r(val, " \t", &saved); tok && rc == 0; tok = strtok_r(NULL, " \t", &saved)) {
+		if (!r->names) {
+			rc = conf_parse_str(tok, &r->names);
+		} else if (!strncmp(tok, "category=", 9)) {
+			rc = conf_parse_str(tok+9, &r->categories);
+		} else if (!strncmp(tok, "key=", 4)) {
+			rc = conf_parse_str(tok+4, &r->keys);
+		} else if (!strncmp(tok, "uid=", 4)) {
+			r->have_uid = 1;
+			rc = conf_parse_range(tok+4, &r->uid_min, &r->uid_max);
+		} else if (!strncmp(tok, "auid=", 5)) {
+			r->have_auid = 1;
+			rc = conf_parse_range(tok+5, &r->auid_min, &r->auid_max);
+		} else {
+			rc = -1;
+		}
+	}
+
+	if (rc || !r->names) {
+		free(r->names);
+		free(r->categories);
+		free(r->keys);
+		free(r);
+		return -1;
+	}
+
+	for (tail = &c->routes; *tail; tail = &(*tail)->next)
+		;
+	*tail = r;
+	return 0;
+}
+
+/* Parse "<name> <type>" */
+static int conf_parse_output(struct plugin_conf *c, char *val)
+{
+	char *name, *type, *saved;
+	int t;
+
+	name = strtok_r(val, " \t", &saved);
+	type = strtok_r(NULL, " \t", &saved);
+	if (!name || !type || strtok_r(NULL, " \t", &saved) || strchr(name, '.') || output_find(c, name))
+		return -1;
+	for (t = OUTPUT_SYSLOG; t < OUTPUT_ANY; t++) {
+		if (!strcmp(type, output_types[t]))
+			break;
+	}
+	/* default output names can only be used with their own type */
+	if (t == OUTPUT_ANY || ((!strcmp(name, "syslog") || !strcmp(name, "archive") || !strcmp(name, "http")) &&
+				strcmp(name, type)))
+		return -1;
+	return output_new(c, name, t) ? 0 : -1;
+}
+
+static int conf_parse_output_kw(struct plugin_conf *c, char *key, const char *val, const char *path, int lineno)
+{
+	const struct conf_kw *kw;
+	output_t *o = NULL;
+	char *dot, *name = NULL;
+	int t;
+
+	dot = strchr(key, '.');
+	if (dot) {
+		*dot = '\0';
+		name = key;
+		key = dot+1;
+	}
+
+	for (kw = conf_keywords; kw->name; kw++) {
+		if (!strcmp(kw->name, key))
+			break;
+	}
+	if (!kw->name) {
+		syslog(LOG_ERR, "%s:%d: unknown keyword %s", path, lineno, key);
+		return -1;
+	}
+
+	if (!name && kw->type == OUTPUT_ANY) {
+		syslog(LOG_ERR, "%s:%d: %s needs an output name, such as syslog.%s", path, lineno, key, key);
+		return -1;
+	}
+	if (!name)
+		name = (char *)output_types[kw->type];
+
+	o = output_find(c, name);
+	if (!o) {
+		/* default outputs are created when first configured */
+		for (t = OUTPUT_SYSLOG; t < OUTPUT_ANY; t++) {
+			if (!strcmp(name, output_types[t]))
+				break;
+		}
+		if (t == OUTPUT_ANY) {
+			syslog(LOG_ERR, "%s:%d: unknown output %s", path, lineno, name);
+			return -1;
+		}
+		o = output_new(c, name, t);
+		if (!o)
+			return -1;
+	}
+
+	if (kw->type != OUTPUT_ANY && kw->type != o->type) {
+		syslog(LOG_ERR, "%s:%d: %s is not a keyword of %s outputs", path, lineno, key, output_types[o->type]);
+		return -1;
+	}
+	if (kw->parser(val, (char *)&o->conf + kw->offset)) {
+		syslog(LOG_ERR, "%s:%d: invalid value for %s: %s", path, lineno, key, val);
+		return -1;
+	}
+	return 0;
+}
+
+/* Validate the outputs and resolve the routes */
+static int conf_check(struct plugin_conf *c, const char *path)
+{
+	output_t *o, *next;
+	route_t *r;
+	char *names, *tok, *saved;
+	int rc = 0;
+
+	for (o = c->outputs; o; o = next) {
+		next = o->next;
+		/* default outputs which lack their destination are disabled, as when they're not configured at all */
+		if ((o->type == OUTPUT_SYSLOG && !strcmp(o->name, "syslog") && !c->syslog_output) ||
+				(o->type == OUTPUT_ARCHIVE && !o->conf.archive_dir && !strcmp(o->name, "archive")) ||
+				(o->type == OUTPUT_HTTP && !o->conf.http_host && !strcmp(o->name, "http"))) {
+			output_remove(c, o);
+			continue;
+		}
+
+		if (o->type == OUTPUT_ARCHIVE && !o->conf.archive_dir) {
+			syslog(LOG_ERR, "%s: output %s needs archive_dir", path, o->name);
+			rc = -1;
+		}
+		if (o->type == OUTPUT_HTTP && !o->conf.http_host) {
+			syslog(LOG_ERR, "%s: output %s needs http_host", path, o->name);
+			rc = -1;
+		}
+		if (o->conf.queue_size == 0) {
+			syslog(LOG_ERR, "%s: %s.queue_size must not be 0", path, o->name);
+			rc = -1;
+		}
+		if (o->conf.syslog_batch_size > MAX_SYSLOG_BATCH) {
+			syslog(LOG_ERR, "%s: %s.syslog_batch_size must be between 0 and %d", path, o->name, MAX_SYSLOG_BATCH);
+			rc = -1;
+		}
+		if (o->conf.archive_compress_level > 9) {
+			syslog(LOG_ERR, "%s: %s.archive_compress_level must be between 0 and 9", path, o->name);
+			rc = -1;
+		}
+		if (o->conf.http_port == 0 || o->conf.http_port > 65535) {
+			syslog(LOG_ERR, "%s: %s.http_port must be between 1 and 65535", path, o->name);
+			rc = -1;
+		}
+		if (o->conf.http_batch_size == 0 || o->conf.http_timeout == 0) {
+			syslog(LOG_ERR, "%s: %s.http_batch_size and http_timeout must not be 0", path, o->name);
+			rc = -1;
+		}
+		if (o->conf.http_pipeline == 0 || o->conf.http_pipeline > HTTP_MAX_PIPELINE) {
+			syslog(LOG_ERR, "%s: %s.http_pipeline must be between 1 and %d", path, o->name, HTTP_MAX_PIPELINE);
+			rc = -1;
+		}
+	}
+
+	if (c->session_idle_timeout == 0) {
+		syslog(LOG_ERR, "%s: session_idle_timeout must not be 0", path);
+		rc = -1;
+	}
+	if (c->session_history_size < 64 || c->session_history_size > MAX_SESSION_HISTORY) {
+		syslog(LOG_ERR, "%s: session_history_size must be between 64 and %d", path, MAX_SESSION_HISTORY);
+		rc = -1;
+	}
+	if (c->checkpoint_sync_interval == 0) {
+		syslog(LOG_ERR, "%s: checkpoint_sync_interval must not be 0", path);
+		rc = -1;
+	}
+	if (c->catchup && !c->checkpoint_file) {
+		syslog(LOG_ERR, "%s: catchup needs checkpoint_file", path);
+		rc = -1;
+	}
+
+	c->nr_outputs = 0;
+	c->http_outputs = 0;
+	for (o = c->outputs; o; o = o->next) {
+		if (c->nr_outputs == MAX_OUTPUTS) {
+			syslog(LOG_ERR, "%s: too many outputs, the maximum is %d", path, MAX_OUTPUTS);
+			return -1;
+		}
+		o->id = c->nr_outputs++;
+		if (o->type == OUTPUT_HTTP)
+			c->http_outputs |= 1U << o->id;
+	}
+
+	for (r = c->routes; r; r = r->next) {
+		names = strdup(r->names);
+		if (!names)
+			return -1;
+		r->outputs = 0;
+		for (tok = strtok_r(names, ",", &saved); tok; tok = strtok_r(NULL, ",", &saved)) {
+			o = output_find(c, tok);
+			if (!o) {
+				syslog(LOG_ERR, "%s: route to unknown or disabled output %s", path, tok);
+				rc = -1;
+				continue;
+			}
+			r->outputs |= 1U << o->id;
+		}
+		free(names);
+	}
+
+	return rc;
+}
+
+/* Free everything load_config() allocated in c */
+void free_config(struct plugin_conf *c)
+{
+	output_t *o;
+	route_t *r;
+
+	while (c->outputs) {
+		o = c->outputs;
+		c->outputs = o->next;
+		output_free(o);
+	}
+	while (c->routes) {
+		r = c->routes;
+		c->routes = r->next;
+		free(r->names);
+		free(r->categories);
+		free(r->keys);
+		free(r);
+	}
+	free(c->checkpoint_file);
+	free(c->catchup_log);
+	c->checkpoint_file = NULL;
+	c->catchup_log = NULL;
+}
+
+/* Load the configuration file into c
+ * @int required: if 0, a missing file is not an error
+ * Returns 0 on success, -1 if the file can't be read or has an invalid line.
+ */
+int load_config(const char *path, struct plugin_conf *c, int required)
+{
+	FILE *fp;
+	char buf[1024];
+	char *line, *key, *val, *eq;
+	const struct conf_kw *kw;
+	int lineno = 0, rc = 0;
+
+	memset(c, 0, sizeof(struct plugin_conf));
+	c->syslog_output = 1;
+	c->session_tracking = SESSION_OFF;
+	c->session_idle_timeout = 1800;
+	c->session_history_size = 2048;
+	c->checkpoint_sync_interval = 5;
+	c->catchup = 0;
+	c->catchup_log = strdup("/var/log/audit/audit.log");
+	if (!c->catchup_log)
+		return -1;
+	if (!output_new(c, "syslog", OUTPUT_SYSLOG))
+		return -1;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		if (errno == ENOENT && !required)
+			return conf_check(c, path);
+		syslog(LOG_ERR, "could not open configuration file %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		lineno++;
+		line = conf_strip(buf);
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		eq = strchr(line, '=');
+		if (!eq) {
+			syslog(LOG_ERR, "%s:%d: missing '=', line ignored", path, lineno);
+			rc = -1;
+			continue;
+		}
+		*eq = '\0';
+		key = conf_strip(line);
+		val = conf_strip(eq+1);
+
+		for (kw = conf_global_keywords; kw->name; kw++) {
+			if (!strcmp(kw->name, key))
+				break;
+		}
+
+		if (kw->name) {
+			if (kw->parser(val, (char *)c + kw->offset)) {
+				syslog(LOG_ERR, "%s:%d: invalid value for %s: %s", path, lineno, key, val);
+				rc = -1;
+			}
+		} else if (!strcmp(key, "output")) {
+			if (conf_parse_output(c, val)) {
+				syslog(LOG_ERR, "%s:%d: invalid output: %s", path, lineno, val);
+				rc = -1;
+			}
+		} else if (!strcmp(key, "route")) {
+			if (conf_parse_route(c, val)) {
+				syslog(LOG_ERR, "%s:%d: invalid route: %s", path, lineno, val);
+				rc = -1;
+			}
+		} else if (conf_parse_output_kw(c, key, val, path, lineno)) {
+			rc = -1;
+		}
+	}
+	fclose(fp);
+
+	if (conf_check(c, path))
+		rc = -1;
+
+	return rc;
+}
+
 int main(int argc, char *argv[])
 {
-	char tmp[MAX_AUDIT_MESSAGE_LENGTH];
-	int len=0;
+	static char inbuf[INPUT_BUF_SIZE];
+	size_t have = 0, used = 0;
+	ssize_t n;
+	char *eol, saved;
+#ifdef REORDER_HACK
+	char *line;
+	size_t len, rlen;
+#endif
 	struct sigaction sa;
 	struct hostent *ht;
 	char nodename[64];
+	int ret, checkpointing = 0;
 
 	sa.sa_flags = 0;
 	sigemptyset(&sa.sa_mask);
@@ -235,9 +1069,24 @@ int main(int argc, char *argv[])
 	sa.sa_handler = int_handler;
 	if (sigaction(SIGINT, &sa, NULL) == -1)
 		return 1;
+	/* a peer resetting the HTTP connection must fail the write, not kill the plugin */
+	sa.sa_handler = SIG_IGN;
+	if (sigaction(SIGPIPE, &sa, NULL) == -1)
+		return 1;
+	sa.sa_handler = hup_handler;
+	if (sigaction(SIGHUP, &sa, NULL) == -1)
+		return 1;
 
 	openlog(PROGRAM_NAME, LOG_CONS, LOG_AUTHPRIV);
 
+	config_path = argc > 1 ? argv[1] : CONFIG_FILE;
+	config_required = argc > 1;
+	config = calloc(1, sizeof(struct plugin_conf));
+	if (!config || load_config(config_path, config, config_required)) {
+		syslog(LOG_ERR, "invalid configuration, exiting");
+		return 1;
+	}
+
 	if (gethostname(nodename, sizeof(nodename)-1)) {
 		snprintf(nodename, 10, "localhost");
 	}
@@ -267,229 +1116,2719 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-#ifdef REORDER_HACK
-	int start = 0;
-	int stop = 0;
-	int i = 0;
-	char *full_str_tmp = malloc(NR_LINES_BUFFERED*MAX_AUDIT_MESSAGE_LENGTH);
-	char *sorted_tmp = malloc(NR_LINES_BUFFERED*MAX_AUDIT_MESSAGE_LENGTH);
-	if (!sorted_tmp || !full_str_tmp) {
-		syslog(LOG_ERR, "main() malloc failed for sorted_tmp || full_str_tmp, this is fatal");
-		return -1;
+	hex_init();
+
+	/* without a usable checkpoint file, events are handled as if checkpointing was disabled */
+	if (config->checkpoint_file) {
+		ret = checkpoint_open();
+		checkpointing = ret >= 0;
+	}
+
+	if (output_start_all()) {
+		syslog(LOG_ERR, "could not start the outputs");
+		return -1;
+	}
+
+	if (checkpointing && ret == 1 && config->catchup)
+		catchup_start();
+
+#ifdef REORDER_HACK
+	int start = 0;
+	int stop = 0;
+	int i = 0;
+	char *full_str_tmp = malloc(NR_LINES_BUFFERED*MAX_AUDIT_MESSAGE_LENGTH);
+	char *sorted_tmp = malloc(NR_LINES_BUFFERED*MAX_AUDIT_MESSAGE_LENGTH);
+	if (!sorted_tmp || !full_str_tmp) {
+		syslog(LOG_ERR, "main() malloc failed for sorted_tmp || full_str_tmp, this is fatal");
+		return -1;
+	}
+	sorted_tmp[0] = '\0';
+	full_str_tmp[0] = '\0';
+#endif
+
+	auparse_add_callback(au, checkpointing ? handle_live_event : handle_event, NULL, NULL);
+	syslog(LOG_INFO, "%s loaded\n", PROGRAM_NAME);
+
+	/* At this point we're initialized so we'll read stdin until closed and feed the data to auparse, which in turn will
+	 * call our callback (handle_event) every time it finds a new complete message to parse.
+	 */
+	/* NOTE: There's quite a few reasons for auparse_feed() from libaudit to fail parsing silently so we have to be careful here.
+	 * Anything passed to it:
+	 * - must have the same timestamp for a given event id. (kernel takes care of that, if not, you're out of luck).
+	 * - must always be LF+NULL terminated ("\n\0"). (we only feed complete lines and NULL terminate them).
+	 * - must always have event ids in sequential order. (REORDER_HACK takes care of that, it also buffer lines, since, well, it needs to).
+	 * stdin is read in INPUT_BUF_SIZE chunks and all the complete lines of a chunk are fed at once, so that busy systems
+	 * get many events per read(). The output threads batch their sends the same way.
+	 */
+	while (sig_stop == 0) {
+		n = read(STDIN_FILENO, inbuf+have, INPUT_BUF_SIZE-1-have);
+		/* configuration reloads progress between chunks of input, thus between events */
+		if (sig_reload || reload_state != RELOAD_IDLE)
+			reload_poll(0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "read from stdin failed: %s", strerror(errno));
+			break;
+		}
+		if (n == 0) {
+			/* EOF, feed what's left as a last line */
+			if (have == 0)
+				break;
+			if (inbuf[have-1] != '\n')
+				inbuf[have++] = '\n';
+			used = have;
+		} else {
+			have += n;
+			eol = memrchr(inbuf, '\n', have);
+			if (eol) {
+				used = eol - inbuf + 1;
+			} else if (have == INPUT_BUF_SIZE-1) {
+				/* no LF in a full buffer, it's not audit data, feed it anyway */
+				used = have;
+			} else {
+				continue;
+			}
+		}
+		saved = inbuf[used];
+		inbuf[used] = '\0';
+		TRACE(input, used);
+
+#ifdef REORDER_HACK
+		for (line = inbuf; line < inbuf+used; line += len) {
+			eol = memchr(line, '\n', inbuf+used-line);
+			len = eol ? eol-line+1 : inbuf+used-line;
+			if (len >= MAX_AUDIT_MESSAGE_LENGTH)
+				len = MAX_AUDIT_MESSAGE_LENGTH-1;
+			if (strncmp(line, "type=EOE", 8) == 0) {
+				stop++;
+			} else if (strncmp(line, "type=SYSCALL", 12) == 0) {
+				start++;
+			}
+			if (i > NR_LINES_BUFFERED || start != stop) {
+				strncat(full_str_tmp, line, len);
+				i++;
+			} else {
+				strncat(full_str_tmp, line, len);
+				rlen = reorder_input_hack(&sorted_tmp, full_str_tmp);
+				auparse_feed(au, sorted_tmp, rlen);
+				i = 0;
+				start = stop = 0;
+				sorted_tmp[0] = '\0';
+				full_str_tmp[0] = '\0';
+			}
+		}
+#else
+		auparse_feed(au, inbuf, used);
+#endif
+		inbuf[used] = saved;
+		have -= used;
+		memmove(inbuf, inbuf+used, have);
+
+		if (n == 0)
+			break;
+	}
+
+	auparse_flush_feed(au);
+	auparse_destroy(au);
+	catchup_wait();
+	reload_finish();
+	session_close_all();
+	output_stop_all();
+	checkpoint_close();
+	free_config(config);
+	free(config);
+	free(hostname);
+#ifdef REORDER_HACK
+	free(sorted_tmp);
+#endif
+	syslog(LOG_INFO, "%s unloaded\n", PROGRAM_NAME);
+	closelog();
+
+	return 0;
+}
+
+/*
+ * This function seeks to the specified record returning its type on succees
+ */
+static int goto_record_type(auparse_state_t *au, int type)
+{
+	int cur_type;
+
+	auparse_first_record(au);
+	do {
+		cur_type = auparse_get_type(au);
+		if (cur_type == type) {
+			auparse_first_field(au);
+			return type;  // Normal exit
+		}
+	} while (auparse_next_record(au) > 0);
+
+	return -1;
+}
+
+/*
+ * Hex encoded field decoding
+ * The kernel logs untrusted strings (exe, comm, cwd, path names, execve arguments) quoted, or hex encoded when they
+ * contain spaces, quotes or control characters. PROCTITLE is always hex encoded with NUL separated arguments.
+ * Blocks of 32 hex digits are decoded with SSE2 (64 with AVX2 where the CPU supports it), the rest byte per byte.
+ */
+/* value+1 of each hex digit, 0 for anything else */
+static const unsigned char hex_values[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+/* Decode len hex digits (len even) from src to dst, returns -1 if src has anything but hex digits */
+static int hex_decode_scalar(char *dst, const char *src, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)src;
+	int hi, lo;
+
+	for (; len >= 2; len -= 2, s += 2) {
+		hi = hex_values[s[0]] - 1;
+		lo = hex_values[s[1]] - 1;
+		if ((hi | lo) < 0)
+			return -1;
+		*dst++ = (char)((hi << 4) | lo);
+	}
+	return 0;
+}
+
+#if defined(__SSE2__)
+/* Turn 16 hex digits into 8 nibble pairs in 16 bit lanes, or return 0 if any of them is not a hex digit */
+static inline int hex_nibbles_sse2(__m128i v, __m128i *out)
+{
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9'+1)));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a'-1)),
+			_mm_cmplt_epi8(lower, _mm_set1_epi8('f'+1)));
+	__m128i n;
+
+	if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff)
+		return 0;
+	n = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+			_mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a'-10))));
+	/* each 16 bit lane holds the high nibble in its low byte and the low nibble in its high byte */
+	*out = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00ff)), 4), _mm_srli_epi16(n, 8));
+	return 1;
+}
+
+static size_t hex_decode_sse2(char *dst, const char *src, size_t len)
+{
+	__m128i a, b;
+	size_t done = 0;
+
+	while (len - done >= 32) {
+		if (!hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)(src + done)), &a) ||
+				!hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)(src + done + 16)), &b))
+			break;
+		_mm_storeu_si128((__m128i *)(dst + done/2), _mm_packus_epi16(a, b));
+		done += 32;
+	}
+	return done;
+}
+
+__attribute__((target("avx2")))
+static size_t hex_decode_avx2(char *dst, const char *src, size_t len)
+{
+	const __m256i zero = _mm256_set1_epi8('0'-1), nine = _mm256_set1_epi8('9'+1);
+	const __m256i a_ = _mm256_set1_epi8('a'-1), f_ = _mm256_set1_epi8('f'+1);
+	__m256i v[2], lower, digit, alpha, n;
+	size_t done = 0;
+	int i;
+
+	while (len - done >= 64) {
+		for (i = 0; i < 2; i++) {
+			v[i] = _mm256_loadu_si256((const __m256i *)(src + done + i*32));
+			lower = _mm256_or_si256(v[i], _mm256_set1_epi8(0x20));
+			digit = _mm256_and_si256(_mm256_cmpgt_epi8(v[i], zero), _mm256_cmpgt_epi8(nine, v[i]));
+			alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, a_), _mm256_cmpgt_epi8(f_, lower));
+			if (_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) != -1)
+				return done;
+			n = _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(v[i], _mm256_set1_epi8('0'))),
+					_mm256_and_si256(alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a'-10))));
+			v[i] = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(n, _mm256_set1_epi16(0x00ff)), 4),
+					_mm256_srli_epi16(n, 8));
+		}
+		/* packus works per 128 bit lane, put the quadwords back in order */
+		n = _mm256_permute4x64_epi64(_mm256_packus_epi16(v[0], v[1]), 0xd8);
+		_mm256_storeu_si256((__m256i *)(dst + done/2), n);
+		done += 64;
+	}
+	return done;
+}
+
+static size_t (*hex_decode_blocks)(char *, const char *, size_t) = hex_decode_sse2;
+
+static void hex_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		hex_decode_blocks = hex_decode_avx2;
+}
+#else
+static void hex_init(void)
+{
+}
+#endif
+
+/* Decode len hex digits from src into dst (len/2 bytes), returns -1 if src is not hex encoded */
+static int hex_decode(char *dst, const char *src, size_t len)
+{
+	size_t done = 0;
+
+	if (len == 0 || len % 2)
+		return -1;
+#if defined(__SSE2__)
+	done = hex_decode_blocks(dst, src, len);
+#endif
+	return hex_decode_scalar(dst + done/2, src + done, len - done);
+}
+
+/* Escape the control characters and backslashes of the n bytes in dst as \u00XX for JSON, in place, dropping whatever
+ * doesn't fit in size-1 bytes. Returns the new length.
+ */
+static size_t field_escape(char *dst, size_t n, size_t size)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	size_t i, len = 0, w;
+
+	for (i = 0; i < n; i++) {
+		c = dst[i];
+		w = c < 0x20 || c == '\\' ? 6 : 1;
+		if (len + w > size-1)
+			break;
+		len += w;
+	}
+
+	/* from the end, so that nothing is overwritten before it has been moved */
+	for (n = i, i = len; n > 0; ) {
+		c = dst[--n];
+		if (c < 0x20 || c == '\\') {
+			i -= 6;
+			memcpy(dst+i, "\\u00", 4);
+			dst[i+4] = hex[c >> 4];
+			dst[i+5] = hex[c & 0xf];
+		} else {
+			dst[--i] = c;
+		}
+	}
+	return len;
+}
+
+/* Copy the value of a string field to dst (at most size-1 bytes, NUL terminated), decoding it if hex encoded and
+ * removing its quotes otherwise. NUL bytes (PROCTITLE argument separators) become sep, trailing ones are dropped.
+ * The kernel hex encodes values with control characters, those and backslashes are escaped as \u00XX once decoded, so
+ * that the only backslashes left start an escape of ours (see unescape()).
+ * @const char *val: raw field value, from auparse_find_field()
+ * Returns the decoded length, or -1 if val is NULL.
+ */
+static int field_decode(char *dst, size_t size, const char *val, char sep)
+{
+	size_t len, n;
+	char *p;
+
+	if (!val || size == 0)
+		return -1;
+
+	len = strlen(val);
+	if (len >= 2 && val[0] == '"' && val[len-1] == '"') {
+		n = len-2 < size-1 ? len-2 : size-1;
+		memcpy(dst, val+1, n);
+		n = field_escape(dst, n, size);
+	} else {
+		/* decode what fits, an odd length is not hex */
+		n = len/2 < size-1 ? len : (size-1)*2;
+		if (len % 2 == 0 && hex_decode(dst, val, n) == 0) {
+			n /= 2;
+			while (n > 0 && dst[n-1] == '\0')
+				n--;
+			for (p = memchr(dst, '\0', n); p; p = memchr(p, '\0', n - (p-dst)))
+				*p = sep;
+			n = field_escape(dst, n, size);
+		} else {
+			n = len < size-1 ? len : size-1;
+			memcpy(dst, val, n);
+		}
+	}
+	dst[n] = '\0';
+	return n;
+}
+
+/* Removes quotes
+ * Remove  CR and LF
+ * Keeps \u00XX escapes, see field_decode(): any other backslash is dropped, so the ones left always start an escape
+ * @const char *in: if NULL, no processing is done.
+ */
+char *unescape(const char *in)
+{
+	if (in == NULL)
+		return NULL;
+
+	char *dst = (char *)in;
+	char *s = dst;
+	char *src = (char *)in;
+	char c;
+
+	while ((c = *src++) != '\0') {
+		if (c == '\\' && src[0] == 'u' && src[1] == '0' && src[2] == '0' && hex_values[(unsigned char)src[3]] &&
+				hex_values[(unsigned char)src[4]]) {
+			*dst++ = c;
+			continue;
+		}
+		if ((c == '"') || (c == '\n') || (c == '\r') || (c == '\t')
+				|| (c == '\b') || (c == '\f') || (c == '\\'))
+			continue;
+		*dst++ = c;
+	}
+	*dst++ = '\0';
+	return s;
+}
+
+/* Cut the incomplete \u00XX escape truncation may have left at the end of an unescape()d string */
+static void escape_trim(char *s)
+{
+	size_t len = strlen(s), i;
+
+	/* a backslash in the last 5 bytes starts an escape which doesn't end before the string */
+	for (i = len > 5 ? len-5 : 0; i < len; i++) {
+		if (s[i] == '\\') {
+			s[i] = '\0';
+			break;
+		}
+	}
+}
+
+/* Add a field to the json msg's details={}
+ * @attr_t *list: the attribute list to extend
+ * @const char *st: the attribute name to add
+ * @const char *val: the attribut value - if NULL, we won't add the field to the json message at all.
+ */
+attr_t *_json_add_attr(attr_t *list, const char *st, char *val, int freeme)
+{
+	attr_t *new;
+
+	if (st == NULL || !strncmp(st, "(null)", 6) || val == NULL || !strncmp(val, "(null)", 6)) {
+		return list;
+	}
+
+	new = malloc(sizeof(attr_t));
+	if (!new) {
+		syslog(LOG_ERR, "json_add_attr() malloc failed attribute will be empty: %s", st);
+		return list;
+	}
+	snprintf(new->value, MAX_ATTR_SIZE, "\"%s\":\"%s\"", st, unescape(val));
+	new->next = list;
+
+	if (freeme) {
+		free(val);
+	}
+
+	return new;
+}
+
+/* Convenience wrappers for _json_add_attr */
+attr_t *json_add_attr_free(attr_t *list, const char *st, char *val)
+{
+	return _json_add_attr(list, st, val, 1);
+}
+
+attr_t *json_add_attr(attr_t *list, const char *st, const char *val)
+{
+	return _json_add_attr(list, st, (char *)val, 0);
+}
+
+void json_del_attrs(attr_t *head)
+{
+	attr_t *prev;
+	while (head) {
+		prev = head;
+		head = head->next;
+		free(prev);
+	}
+}
+
+/* Resolve uid to username - returns malloc'd value */
+static char *_get_username(int uid)
+{
+	size_t bufsize;
+	char *buf;
+	char *name;
+	struct passwd pwd;
+	struct passwd *result;
+
+	bufsize = sysconf(_SC_GETPW_R_SIZE_MAX);
+	if (bufsize == -1)
+		bufsize = 16384;
+	buf = (char *)alloca(bufsize);
+	if (!buf) {
+		return NULL;
+	}
+
+	if (uid == -1) {
+		return NULL;
+	}
+	if (getpwuid_r(uid, &pwd, buf, bufsize, &result) != 0) {
+		return NULL;
+	}
+	if (result == NULL) {
+		return NULL;
+	}
+	name = strdup(pwd.pw_name);
+	return name;
+}
+
+char *get_username(int uid)
+{
+	char *name;
+
+	TRACE(username_start, uid);
+	name = _get_username(uid);
+	TRACE(username_end, uid, name != NULL);
+	return name;
+}
+
+/* Resolve process name from pid
+ * /proc/<pid>/comm holds the same value as the Name: line of /proc/<pid>/status and is read without stdio.
+ */
+char *get_proc_name(int pid)
+{
+	char p[64];
+	static char proc[64];
+	ssize_t ret;
+	int fd;
+
+	snprintf(p, sizeof(p), "/proc/%d/comm", pid);
+	fd = open(p, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	ret = read(fd, proc, sizeof(proc)-1);
+	close(fd);
+
+	if (ret <= 0)
+		return NULL;
+	if (proc[ret-1] == '\n')
+		ret--;
+	proc[ret] = '\0';
+
+	return ret ? proc : NULL;
+}
+
+/*
+ * Process table
+ * Keeps the last PROC_TABLE_SIZE processes seen in SYSCALL records (pid, ppid, exe, comm, auid, ses) so that the parent
+ * process and the ancestry chain of an event can be resolved with hash lookups instead of reading /proc/<ppid>/status,
+ * which is slow and usually fails for short lived processes anyway.
+ * Entries are created/refreshed by every SYSCALL record, children are created from clone()/fork()/vfork() return
+ * values and exit()/exit_group() only mark the entry as exited so that the lineage of its children is still available
+ * until it gets evicted. Eviction is LRU, exited processes are evicted first.
+ */
+static unsigned int proc_hash(int pid)
+{
+	return ((unsigned int)pid * 2654435761U) & (PROC_TABLE_BUCKETS - 1);
+}
+
+static void proc_lru_unlink(proc_t *p)
+{
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		proc_lru_head = p->next;
+	if (p->next)
+		p->next->prev = p->prev;
+	else
+		proc_lru_tail = p->prev;
+	p->prev = p->next = NULL;
+}
+
+static void proc_lru_push_head(proc_t *p)
+{
+	p->prev = NULL;
+	p->next = proc_lru_head;
+	if (proc_lru_head)
+		proc_lru_head->prev = p;
+	proc_lru_head = p;
+	if (!proc_lru_tail)
+		proc_lru_tail = p;
+}
+
+static void proc_lru_push_tail(proc_t *p)
+{
+	p->next = NULL;
+	p->prev = proc_lru_tail;
+	if (proc_lru_tail)
+		proc_lru_tail->next = p;
+	proc_lru_tail = p;
+	if (!proc_lru_head)
+		proc_lru_head = p;
+}
+
+/* Returns the entry for pid or NULL, marking it as recently used */
+proc_t *proc_table_find(int pid)
+{
+	proc_t *p;
+
+	for (p = proc_buckets[proc_hash(pid)]; p; p = p->hnext) {
+		if (p->pid == pid) {
+			if (p != proc_lru_head && !p->exited) {
+				proc_lru_unlink(p);
+				proc_lru_push_head(p);
+			}
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* Returns the entry for pid, creating it (and evicting the least recently used entry if needed) */
+static proc_t *proc_table_get(int pid)
+{
+	proc_t *p, **pp;
+
+	p = proc_table_find(pid);
+	if (p)
+		return p;
+
+	if (proc_table_used < PROC_TABLE_SIZE) {
+		p = &proc_table[proc_table_used++];
+	} else {
+		p = proc_lru_tail;
+		for (pp = &proc_buckets[proc_hash(p->pid)]; *pp; pp = &(*pp)->hnext) {
+			if (*pp == p) {
+				*pp = p->hnext;
+				break;
+			}
+		}
+		proc_lru_unlink(p);
+	}
+
+	memset(p, 0, sizeof(proc_t));
+	p->pid = pid;
+	p->ppid = -1;
+	p->auid = -1;
+	p->ses = -1;
+	p->hnext = proc_buckets[proc_hash(pid)];
+	proc_buckets[proc_hash(pid)] = p;
+	proc_lru_push_head(p);
+	return p;
+}
+
+/* Copy an audit field value without its quotes */
+static void proc_copy_str(char *dst, size_t size, const char *src)
+{
+	size_t i = 0;
+
+	if (!src)
+		return;
+	for (; *src && i < size-1; src++) {
+		if (*src != '"')
+			dst[i++] = *src;
+	}
+	dst[i] = '\0';
+}
+
+/* A pid seen again after its exit is a new process, which is recently used */
+static void proc_table_revive(proc_t *p)
+{
+	if (!p->exited)
+		return;
+	p->exited = 0;
+	proc_lru_unlink(p);
+	proc_lru_push_head(p);
+}
+
+typedef enum {
+	PROC_OP_NONE,
+	PROC_OP_FORK,
+	PROC_OP_EXIT
+} proc_op_t;
+
+/* Update the process table from a SYSCALL record's values
+ * @int exitval: the syscall return value, i.e. the child pid for PROC_OP_FORK
+ */
+void proc_table_update(proc_op_t op, int pid, int ppid, const char *exe, const char *comm, int auid, int ses,
+		int exitval)
+{
+	proc_t *p, *child;
+
+	if (pid <= 0)
+		return;
+
+	p = proc_table_get(pid);
+	proc_table_revive(p);
+	if (ppid > 0)
+		p->ppid = ppid;
+	p->auid = auid;
+	p->ses = ses;
+	proc_copy_str(p->exe, PROC_EXE_LEN, exe);
+	proc_copy_str(p->comm, PROC_COMM_LEN, comm);
+
+	if (op == PROC_OP_FORK && exitval > 0) {
+		/* p is at the head of the LRU list so it can't be evicted here */
+		child = proc_table_get(exitval);
+		memcpy(child->exe, p->exe, PROC_EXE_LEN);
+		memcpy(child->comm, p->comm, PROC_COMM_LEN);
+		proc_table_revive(child);
+		child->ppid = pid;
+		child->auid = auid;
+		child->ses = ses;
+	} else if (op == PROC_OP_EXIT) {
+		p->exited = 1;
+		proc_lru_unlink(p);
+		proc_lru_push_tail(p);
+	}
+}
+
+/* Resolve process name from pid, from the process table or /proc as a fallback
+ * Names read from /proc are kept in the table, until a SYSCALL record of pid refreshes them.
+ */
+char *proc_table_name(int pid)
+{
+	proc_t *p;
+	char *name;
+
+	TRACE(procname_start, pid);
+	p = proc_table_find(pid);
+	if (p && p->comm[0]) {
+		TRACE(procname_end, pid, 1);
+		return p->comm;
+	}
+	name = get_proc_name(pid);
+	if (name && pid > 0) {
+		p = proc_table_get(pid);
+		proc_copy_str(p->comm, PROC_COMM_LEN, name);
+		name = p->comm;
+	}
+	TRACE(procname_end, pid, name ? 2 : 0);
+	return name;
+}
+
+/* Write the exe names of pid and its ancestors (up to PROC_LINEAGE_DEPTH) to buf as a comma separated list
+ * Only whole names are written, the list stops at the first one which does not fit in size.
+ * Returns NULL if pid is unknown.
+ */
+char *proc_table_lineage(int pid, char *buf, size_t size)
+{
+	proc_t *p;
+	size_t len = 0, n;
+	int depth;
+
+	buf[0] = '\0';
+	for (depth = 0; depth < PROC_LINEAGE_DEPTH && pid > 0; depth++) {
+		p = proc_table_find(pid);
+		if (!p || !p->exe[0])
+			break;
+		n = strlen(p->exe) + (len ? 1 : 0);
+		if (len + n >= size)
+			break;
+		snprintf(buf+len, size-len, "%s%s", len ? "," : "", p->exe);
+		len += n;
+		pid = p->ppid;
+	}
+
+	return buf[0] ? buf : NULL;
+}
+
+/*
+ * Session tracking
+ * When session_tracking is enabled, the commands, cwd changes and file writes of each login session (ses, with an
+ * auid set) are accumulated in a bounded history and a single "session" event summarizing them is sent when the
+ * session ends, has been idle for session_idle_timeout seconds (of audit time), or when its entry is needed for a new
+ * session. Sessions still open on exit are sent as well. A session ends on USER_LOGOUT, or on USER_END from the process
+ * which logged in: sudo and su log USER_END with the ses of their caller when they close their own PAM session.
+ * Sessions without any command or write are dropped silently.
+ */
+static unsigned int session_hash(int ses)
+{
+	return ((unsigned int)ses * 2654435761U) & (SESSION_TABLE_BUCKETS - 1);
+}
+
+static void session_lru_unlink(session_t *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		session_lru_head = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	else
+		session_lru_tail = s->prev;
+	s->prev = s->next = NULL;
+}
+
+/* Link s in the LRU list, which is kept sorted by last (most recent first) so that session_expire() can stop at the
+ * first session which hasn't expired. Events are mostly in order, an out of order one walks past a few entries.
+ */
+static void session_lru_insert(session_t *s)
+{
+	session_t *n = session_lru_head, *p = NULL;
+
+	while (n && n->last > s->last) {
+		p = n;
+		n = n->next;
+	}
+	s->prev = p;
+	s->next = n;
+	if (p)
+		p->next = s;
+	else
+		session_lru_head = s;
+	if (n)
+		n->prev = s;
+	else
+		session_lru_tail = s;
+}
+
+static session_t *session_find(int ses)
+{
+	session_t *s;
+
+	for (s = session_buckets[session_hash(ses)]; s; s = s->hnext) {
+		if (s->ses == ses)
+			return s;
+	}
+	return NULL;
+}
+
+/* Send the summary of s and release its entry
+ * @const char *reason: why the session summary is sent (logout, idle, evicted, shutdown)
+ */
+static void session_close(session_t *s, const char *reason)
+{
+	struct json_msg_type json_msg = {
+		.category	= "session",
+		.hostname	= hostname,
+		.time		= s->last,
+		.milli		= 0,
+		.serial		= 0,
+		.key		= NULL,
+		.uid		= -1,
+		.auid		= s->auid,
+		.details	= NULL,
+	};
+	char summary[MAX_SUMMARY_LEN], timestamp[TS_LEN], start[TS_LEN], endreason[16], yes[] = "yes";
+	char ses[16], auid[16], duration[32], commands[32], writes[32], cwds[32];
+	session_t **sp;
+	char *user;
+
+	/* only opened by a LOGIN record */
+	if (!s->commands && !s->writes)
+		goto release;
+
+	strftime(timestamp, TS_LEN, "%FT%T%z", localtime(&s->last));
+	strftime(start, TS_LEN, "%FT%T%z", localtime(&s->start));
+	snprintf(ses, sizeof(ses), "%d", s->ses);
+	snprintf(auid, sizeof(auid), "%d", s->auid);
+	snprintf(duration, sizeof(duration), "%ld", (long)(s->last - s->start));
+	snprintf(commands, sizeof(commands), "%lu", s->commands);
+	snprintf(writes, sizeof(writes), "%lu", s->writes);
+	snprintf(cwds, sizeof(cwds), "%lu", s->cwds);
+	snprintf(endreason, sizeof(endreason), "%s", reason);
+	user = get_username(s->auid);
+	snprintf(summary, MAX_SUMMARY_LEN, "Session %d of %s: %lu commands, %lu writes", s->ses, user ? user : auid,
+			s->commands, s->writes);
+	json_msg.summary = summary;
+	json_msg.timestamp = timestamp;
+
+	json_msg.details = json_add_attr(json_msg.details, "session", ses);
+	json_msg.details = json_add_attr(json_msg.details, "originaluid", auid);
+	json_msg.details = json_add_attr_free(json_msg.details, "originaluser", user);
+	json_msg.details = json_add_attr(json_msg.details, "start", start);
+	json_msg.details = json_add_attr(json_msg.details, "duration", duration);
+	json_msg.details = json_add_attr(json_msg.details, "commands", commands);
+	json_msg.details = json_add_attr(json_msg.details, "writes", writes);
+	json_msg.details = json_add_attr(json_msg.details, "cwdchanges", cwds);
+	json_msg.details = json_add_attr(json_msg.details, "history", s->history);
+	if (s->truncated)
+		json_msg.details = json_add_attr(json_msg.details, "historytruncated", yes);
+	json_msg.details = json_add_attr(json_msg.details, "endreason", endreason);
+	TRACE(session_close, s->ses, s->commands, reason);
+	syslog_json_msg(json_msg);
+
+release:
+	for (sp = &session_buckets[session_hash(s->ses)]; *sp; sp = &(*sp)->hnext) {
+		if (*sp == s) {
+			*sp = s->hnext;
+			break;
+		}
+	}
+	session_lru_unlink(s);
+	s->hnext = session_free;
+	session_free = s;
+}
+
+/* Returns the entry for ses, creating it (and closing the least recently active session if needed) */
+static session_t *session_get(int ses, int auid, time_t now)
+{
+	session_t *s;
+	char *history;
+
+	s = session_find(ses);
+	if (s && s->auid != auid) {
+		/* the session id was reused */
+		session_close(s, "logout");
+		s = NULL;
+	}
+	if (s)
+		return s;
+
+	if (session_free) {
+		s = session_free;
+		session_free = s->hnext;
+	} else if (session_table_used < SESSION_TABLE_SIZE) {
+		s = &session_table[session_table_used++];
+	} else {
+		session_close(session_lru_tail, "evicted");
+		s = session_free;
+		session_free = s->hnext;
+	}
+
+	history = s->history;
+	if (!history || s->size != config->session_history_size) {
+		history = realloc(history, config->session_history_size);
+		if (!history) {
+			syslog(LOG_ERR, "session_get() malloc failed, session %d not tracked", ses);
+			s->hnext = session_free;
+			session_free = s;
+			return NULL;
+		}
+	}
+	memset(s, 0, sizeof(session_t));
+	s->history = history;
+	s->size = config->session_history_size;
+	s->history[0] = '\0';
+	s->ses = ses;
+	s->auid = auid;
+	s->start = now;
+	s->last = now;
+	s->hnext = session_buckets[session_hash(ses)];
+	session_buckets[session_hash(ses)] = s;
+	session_lru_insert(s);
+	return s;
+}
+
+/* Append "+<seconds since start> <what><value>" to the session history */
+static void session_append(session_t *s, const char *what, const char *val)
+{
+	int n;
+
+	if (s->truncated)
+		return;
+	n = snprintf(s->history + s->len, s->size - s->len, "%s+%ld %s%s", s->len ? "; " : "",
+			(long)(s->last - s->start), what, val);
+	if (n < 0 || (size_t)n >= s->size - s->len) {
+		/* drop the partial entry */
+		s->history[s->len] = '\0';
+		s->truncated = 1;
+		return;
+	}
+	s->len += n;
+}
+
+/* FNV-1a */
+static unsigned int session_str_hash(const char *str)
+{
+	unsigned int h = 2166136261U;
+
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619U;
+	return h;
+}
+
+/* Record an event of session ses
+ * @const char *cmd: the command line of an execve event, or NULL
+ * @const char *written: the path of a file write event, or NULL
+ * @const char *cwd: the event's working directory, or NULL
+ * Returns 1 if the event has been recorded in the session history.
+ */
+int session_record(int ses, int auid, time_t now, const char *cmd, const char *written, const char *cwd)
+{
+	session_t *s;
+	unsigned int h;
+
+	if (ses == -1 || auid == -1 || (!cmd && !written))
+		return 0;
+	s = session_get(ses, auid, now);
+	if (!s)
+		return 0;
+	/* an out of order event doesn't make the session more recently active */
+	if (now > s->last) {
+		s->last = now;
+		if (s != session_lru_head) {
+			session_lru_unlink(s);
+			session_lru_insert(s);
+		}
+	}
+
+	if (cwd && cwd[0]) {
+		h = session_str_hash(cwd);
+		if (s->cwds == 0 || h != s->cwd_hash) {
+			s->cwd_hash = h;
+			s->cwds++;
+			session_append(s, "cd ", cwd);
+		}
+	}
+	if (cmd) {
+		s->commands++;
+		session_append(s, "", cmd);
+	}
+	if (written) {
+		s->writes++;
+		session_append(s, "write ", written);
+	}
+	return 1;
+}
+
+/* Start tracking session ses from its kernel LOGIN record, pid being the process which logged in */
+void session_login(int ses, int auid, int pid, time_t now)
+{
+	session_t *s;
+
+	if (ses == -1 || auid == -1)
+		return;
+	s = session_get(ses, auid, now);
+	if (s)
+		s->login_pid = pid;
+}
+
+/* Close session ses, if tracked, after a logout
+ * @int pid: process which logged USER_END, or -1 for USER_LOGOUT
+ */
+void session_end(int ses, int pid)
+{
+	session_t *s = session_find(ses);
+
+	if (s && (pid == -1 || (s->login_pid && s->login_pid == pid)))
+		session_close(s, "logout");
+}
+
+/* Close the sessions without any event since session_idle_timeout seconds before now */
+void session_expire(time_t now)
+{
+	while (session_lru_tail && session_lru_tail->last + (time_t)config->session_idle_timeout <= now)
+		session_close(session_lru_tail, "idle");
+}
+
+void session_close_all(void)
+{
+	while (session_lru_tail)
+		session_close(session_lru_tail, "shutdown");
+}
+
+/*
+ * Checkpoint and catch-up
+ * When checkpoint_file is set, the id (time, milli, serial) of the last event sent is kept in a small mmap'd file.
+ * Each msg_t carries the id of the event handled before its own, and every output exposes the oldest msg it has not
+ * sent yet (queued, or being sent by its thread). The checkpoint is the last event handled, held back to the oldest of
+ * these. Outputs publish their oldest msg through a seqlock (see output_oldest_update()), so the event path moves the
+ * checkpoint after each event without taking any output lock, and the output threads never touch it. Msgs dropped on
+ * queue overflow count as sent, msgs not sent on stop hold the checkpoint. Updating the file is a few stores; the
+ * kernel writes it back on its own even if the plugin crashes. A thread msyncs it every checkpoint_sync_interval
+ * seconds against power loss, after moving the checkpoint past what the outputs sent while no event came. The file has
+ * two slots written alternately, so a torn write leaves the previous slot valid.
+ * With catchup = yes, a thread reads the audit logs (catchup_log and its rotated files) from the checkpoint on
+ * startup, in parallel with the live input. The two overlap for events which reach the logs before the plugin sees
+ * them live. Live events up to the last one replayed are dropped, and the replay stops at the first event seen live.
+ * Event handling itself is serialized with event_lock while the catch-up runs. The checkpoint only follows the replay
+ * until it is done, so that a crash during the catch-up never skips part of the backlog.
+ * Locking order: event_lock, then checkpoint_lock or an output lock.
+ */
+struct checkpoint_slot {
+	uint64_t gen;
+	uint64_t time;
+	uint64_t serial;
+	uint32_t milli;
+	uint32_t sum;
+};
+
+struct checkpoint_file {
+	char magic[8];
+	struct checkpoint_slot slot[2];
+};
+
+static struct checkpoint_file *checkpoint = NULL;
+static uint64_t checkpoint_gen = 0;
+static event_id_t checkpoint_start;	/* checkpoint found on startup */
+static event_id_t checkpoint_last;	/* last checkpoint written */
+static event_id_t handled_last;	/* last event handled, written by the event path only */
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t checkpoint_thread;
+static int checkpoint_thread_started = 0;
+static int checkpoint_stop = 0;
+
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t catchup_thread;
+static int catchup_started = 0;
+static int catchup_running = 0;	/* read without event_lock by the live path */
+static int catchup_overlap = 0;	/* live events may still have been replayed */
+static int have_live_first = 0;
+static event_id_t live_first;	/* first and last events handled live during the catch-up */
+static event_id_t live_last;
+static event_id_t catchup_last;	/* last event replayed */
+
+static int event_id_cmp(const event_id_t *a, const event_id_t *b)
+{
+	if (a->time != b->time)
+		return a->time < b->time ? -1 : 1;
+	if (a->milli != b->milli)
+		return a->milli < b->milli ? -1 : 1;
+	if (a->serial != b->serial)
+		return a->serial < b->serial ? -1 : 1;
+	return 0;
+}
+
+static void event_get_id(auparse_state_t *au, event_id_t *id)
+{
+	auparse_first_record(au);
+	id->time = auparse_get_time(au);
+	id->milli = auparse_get_milli(au);
+	id->serial = auparse_get_serial(au);
+}
+
+static uint32_t checkpoint_sum(const struct checkpoint_slot *s)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < offsetof(struct checkpoint_slot, sum); i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h;
+}
+
+static void checkpoint_write(const event_id_t *id)
+{
+	struct checkpoint_slot *s;
+
+	s = &checkpoint->slot[++checkpoint_gen & 1];
+	s->gen = checkpoint_gen;
+	s->time = id->time;
+	s->milli = id->milli;
+	s->serial = id->serial;
+	s->sum = checkpoint_sum(s);
+	checkpoint_last = *id;
+}
+
+/* Publish the oldest msg o has not sent yet, o->lock must be held (it serializes the writers of the seqlock) */
+static void output_oldest_update(output_t *o)
+{
+	const event_id_t *after = NULL;
+	unsigned int seq = __atomic_load_n(&o->oldest_seq, __ATOMIC_RELAXED);
+
+	/* what is being sent was queued before what is left in the queue */
+	if (o->unsent)
+		after = &o->unsent_after;
+	else if (o->head)
+		after = &o->head->msg->after;
+
+	__atomic_store_n(&o->oldest_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&o->oldest, after != NULL, __ATOMIC_RELAXED);
+	if (after) {
+		__atomic_store_n(&o->oldest_after.time, after->time, __ATOMIC_RELAXED);
+		__atomic_store_n(&o->oldest_after.milli, after->milli, __ATOMIC_RELAXED);
+		__atomic_store_n(&o->oldest_after.serial, after->serial, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&o->oldest_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Read the oldest msg o has not sent yet into after, without o->lock. Returns 0 if o has sent everything queued. */
+static int output_oldest_read(output_t *o, event_id_t *after)
+{
+	unsigned int seq;
+	int oldest;
+
+	do {
+		seq = __atomic_load_n(&o->oldest_seq, __ATOMIC_ACQUIRE);
+		oldest = __atomic_load_n(&o->oldest, __ATOMIC_RELAXED);
+		after->time = __atomic_load_n(&o->oldest_after.time, __ATOMIC_RELAXED);
+		after->milli = __atomic_load_n(&o->oldest_after.milli, __ATOMIC_RELAXED);
+		after->serial = __atomic_load_n(&o->oldest_after.serial, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&o->oldest_seq, __ATOMIC_RELAXED));
+	return oldest;
+}
+
+/* Move the checkpoint up to handled_last, or to the oldest msg not sent yet
+ * checkpoint_lock must be held, and config->outputs must not be relinked meanwhile: this runs on the event path, which
+ * does the relinking, or with event_lock held.
+ */
+static void checkpoint_advance(void)
+{
+	event_id_t cp = handled_last, after;
+	output_t *o;
+
+	for (o = config->outputs; o; o = o->next) {
+		if (output_oldest_read(o, &after) && event_id_cmp(&after, &cp) < 0)
+			cp = after;
+	}
+	if (event_id_cmp(&cp, &checkpoint_last) > 0)
+		checkpoint_write(&cp);
+}
+
+/* Called by the event path once the event id has been handled, its msgs are queued */
+static void checkpoint_handled(const event_id_t *id)
+{
+	if (!checkpoint)
+		return;
+	pthread_mutex_lock(&checkpoint_lock);
+	handled_last = *id;
+	checkpoint_advance();
+	pthread_mutex_unlock(&checkpoint_lock);
+}
+
+/* Flush the checkpoint to disk every checkpoint_sync_interval seconds, once moved past what was sent meanwhile */
+static void *checkpoint_thread_main(void *arg)
+{
+	unsigned long interval = config->checkpoint_sync_interval;
+	uint64_t gen, synced = 0;
+	struct timespec ts;
+
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += interval;
+		pthread_mutex_lock(&checkpoint_lock);
+		while (!checkpoint_stop && pthread_cond_timedwait(&checkpoint_cond, &checkpoint_lock, &ts) != ETIMEDOUT)
+			;
+		if (checkpoint_stop) {
+			pthread_mutex_unlock(&checkpoint_lock);
+			break;
+		}
+		pthread_mutex_unlock(&checkpoint_lock);
+
+		pthread_mutex_lock(&event_lock);
+		pthread_mutex_lock(&checkpoint_lock);
+		checkpoint_advance();
+		gen = checkpoint_gen;
+		pthread_mutex_unlock(&checkpoint_lock);
+		interval = config->checkpoint_sync_interval;
+		pthread_mutex_unlock(&event_lock);
+
+		if (gen != synced) {
+			msync(checkpoint, sizeof(struct checkpoint_file), MS_SYNC);
+			synced = gen;
+		}
+	}
+	return NULL;
+}
+
+/* Map checkpoint_file and read the last checkpoint into checkpoint_start
+ * Returns 1 if a checkpoint was found, 0 if not, -1 if the file can't be used.
+ */
+int checkpoint_open(void)
+{
+	struct checkpoint_slot *s, *last = NULL;
+	struct stat st;
+	sigset_t all, old;
+	int fd, i, ret;
+
+	fd = open(config->checkpoint_file, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if (fd < 0 || fstat(fd, &st) ||
+			(st.st_size < (off_t)sizeof(struct checkpoint_file) && ftruncate(fd, sizeof(struct checkpoint_file)))) {
+		syslog(LOG_ERR, "could not open checkpoint file %s: %s", config->checkpoint_file, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	checkpoint = mmap(NULL, sizeof(struct checkpoint_file), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (checkpoint == MAP_FAILED) {
+		syslog(LOG_ERR, "could not map checkpoint file %s: %s", config->checkpoint_file, strerror(errno));
+		checkpoint = NULL;
+		return -1;
+	}
+
+	if (memcmp(checkpoint->magic, "AGCKPT1", 8)) {
+		memset(checkpoint, 0, sizeof(struct checkpoint_file));
+		memcpy(checkpoint->magic, "AGCKPT1", 8);
+	}
+	for (i = 0; i < 2; i++) {
+		s = &checkpoint->slot[i];
+		if (s->gen && s->sum == checkpoint_sum(s) && (!last || s->gen > last->gen))
+			last = s;
+	}
+	if (last) {
+		checkpoint_gen = last->gen;
+		checkpoint_start.time = last->time;
+		checkpoint_start.milli = last->milli;
+		checkpoint_start.serial = last->serial;
+		checkpoint_last = handled_last = checkpoint_start;
+	}
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&checkpoint_thread, NULL, checkpoint_thread_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret)
+		syslog(LOG_ERR, "could not start the checkpoint thread, %s is only flushed on exit: %s",
+				config->checkpoint_file, strerror(ret));
+	else
+		checkpoint_thread_started = 1;
+	return last != NULL;
+}
+
+/* Stop the checkpoint thread and write the final checkpoint, once the outputs are stopped */
+void checkpoint_close(void)
+{
+	if (!checkpoint)
+		return;
+	if (checkpoint_thread_started) {
+		pthread_mutex_lock(&checkpoint_lock);
+		checkpoint_stop = 1;
+		pthread_cond_signal(&checkpoint_cond);
+		pthread_mutex_unlock(&checkpoint_lock);
+		pthread_join(checkpoint_thread, NULL);
+		checkpoint_thread_started = 0;
+	}
+	pthread_mutex_lock(&checkpoint_lock);
+	checkpoint_advance();
+	pthread_mutex_unlock(&checkpoint_lock);
+	msync(checkpoint, sizeof(struct checkpoint_file), MS_SYNC);
+	munmap(checkpoint, sizeof(struct checkpoint_file));
+	checkpoint = NULL;
+}
+
+/* auparse callback used instead of handle_event() when checkpointing */
+static void handle_live_event(auparse_state_t *au, auparse_cb_event_t cb_event_type, void *user_data)
+{
+	event_id_t id;
+
+	if (cb_event_type != AUPARSE_CB_EVENT_READY)
+		return;
+	event_get_id(au, &id);
+
+	if (__atomic_load_n(&catchup_running, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&event_lock);
+		if (event_id_cmp(&id, &catchup_last) > 0) {
+			if (!have_live_first) {
+				live_first = id;
+				have_live_first = 1;
+			}
+			live_last = id;
+			handle_event(au, cb_event_type, user_data);
+		}
+		pthread_mutex_unlock(&event_lock);
+		return;
+	}
+
+	if (catchup_overlap) {
+		if (event_id_cmp(&id, &catchup_last) <= 0)
+			return;
+		catchup_overlap = 0;
+	}
+	handle_event(au, cb_event_type, user_data);
+	checkpoint_handled(&id);
+}
+
+static void *catchup_thread_main(void *arg)
+{
+	auparse_state_t *cau = arg;
+	event_id_t id;
+	unsigned long count = 0;
+
+	while (!sig_stop && auparse_next_event(cau) > 0) {
+		event_get_id(cau, &id);
+		if (event_id_cmp(&id, &checkpoint_start) <= 0)
+			continue;
+
+		pthread_mutex_lock(&event_lock);
+		if (have_live_first && event_id_cmp(&id, &live_first) >= 0) {
+			pthread_mutex_unlock(&event_lock);
+			break;
+		}
+		handle_event(cau, AUPARSE_CB_EVENT_READY, NULL);
+		catchup_last = id;
+		checkpoint_handled(&id);
+		pthread_mutex_unlock(&event_lock);
+		count++;
+	}
+
+	pthread_mutex_lock(&event_lock);
+	/* an interrupted catch-up leaves the checkpoint where the replay stopped */
+	if (!sig_stop && have_live_first && event_id_cmp(&live_last, &catchup_last) > 0)
+		checkpoint_handled(&live_last);
+	syslog(LOG_INFO, "catch-up %s, %lu events replayed from %s", sig_stop ? "interrupted" : "done", count,
+			config->catchup_log);
+	catchup_overlap = 1;
+	__atomic_store_n(&catchup_running, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&event_lock);
+
+	auparse_destroy(cau);
+	return NULL;
+}
+
+/* Start replaying the audit logs written after checkpoint_start
+ * catchup_log.N (oldest first) to catchup_log are read, skipping the files last modified before the checkpoint.
+ */
+int catchup_start(void)
+{
+	auparse_state_t *cau;
+	char *files[101];
+	char path[PATH_MAX];
+	struct stat st;
+	sigset_t all, old;
+	int i, n = 0, ret;
+
+	for (i = 100; i >= 0 && n < 100; i--) {
+		if (i)
+			snprintf(path, sizeof(path), "%s.%d", config->catchup_log, i);
+		else
+			snprintf(path, sizeof(path), "%s", config->catchup_log);
+		if (stat(path, &st) || st.st_mtime < checkpoint_start.time)
+			continue;
+		files[n] = strdup(path);
+		if (!files[n])
+			break;
+		n++;
+	}
+	files[n] = NULL;
+
+	if (n == 0) {
+		syslog(LOG_INFO, "catch-up: no audit log newer than the checkpoint in %s", config->catchup_log);
+		return 0;
+	}
+
+	cau = auparse_init(AUSOURCE_FILE_ARRAY, files);
+	for (i = 0; i < n; i++)
+		free(files[i]);
+	if (!cau) {
+		syslog(LOG_ERR, "catch-up: could not initialize auparse for %s", config->catchup_log);
+		return -1;
+	}
+
+	catchup_running = 1;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&catchup_thread, NULL, catchup_thread_main, cau);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		syslog(LOG_ERR, "catch-up: could not start thread: %s", strerror(ret));
+		catchup_running = 0;
+		auparse_destroy(cau);
+		return -1;
+	}
+	catchup_started = 1;
+	return 0;
+}
+
+/* Wait for the catch-up to finish, it stops early if sig_stop is set */
+void catchup_wait(void)
+{
+	if (catchup_started)
+		pthread_join(catchup_thread, NULL);
+	catchup_started = 0;
+}
+
+/*
+ * Outputs
+ * Every output has its own bounded queue drained by its own thread, so that a slow or unreachable destination never
+ * stalls the input path or the other outputs. Messages are serialized once by syslog_json_msg() into a reference
+ * counted msg_t which is queued to each output the message is routed to (see route_event()).
+ * When a queue is full, the oldest queued message (queue_overflow = drop_oldest, the default) or the new message
+ * (drop_newest) is dropped and the loss is logged by the output thread.
+ */
+static void msg_put(msg_t *m)
+{
+	if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(m);
+}
+
+/* Release a list of queue entries and their messages */
+static void queue_free(queue_t *head)
+{
+	queue_t *prev;
+
+	while (head) {
+		prev = head;
+		head = head->next;
+		msg_put(prev->msg);
+		free(prev);
+	}
+}
+
+/* Queue m to o, the caller's reference to m is handed over to the queue */
+static void output_enqueue(output_t *o, msg_t *m)
+{
+	queue_t *new, *old = NULL;
+
+	new = malloc(sizeof(queue_t));
+	if (!new) {
+		syslog(LOG_ERR, "output_enqueue() malloc failed, message lost for output %s!", o->name);
+		msg_put(m);
+		return;
+	}
+	new->msg = m;
+	new->next = NULL;
+
+	pthread_mutex_lock(&o->lock);
+	if (o->size >= o->conf.queue_size) {
+		o->dropped++;
+		if (o->conf.queue_drop_newest) {
+			pthread_mutex_unlock(&o->lock);
+			queue_free(new);
+			return;
+		}
+		old = o->head;
+		o->head = old->next;
+		if (!o->head)
+			o->tail = NULL;
+		old->next = NULL;
+		o->size--;
+	}
+	if (o->tail)
+		o->tail->next = new;
+	else
+		o->head = new;
+	o->tail = new;
+	o->size++;
+	if (o->head == new || old)
+		output_oldest_update(o);
+	pthread_cond_signal(&o->cond);
+	pthread_mutex_unlock(&o->lock);
+
+	queue_free(old);
+}
+
+/* Put a list of count entries back at the head of the queue, to be retried */
+static void output_requeue(output_t *o, queue_t *head, queue_t *tail, unsigned int count)
+{
+	pthread_mutex_lock(&o->lock);
+	tail->next = o->head;
+	o->head = head;
+	if (!o->tail)
+		o->tail = tail;
+	o->size += count;
+	/* the queue bound is enforced again by output_enqueue() on the next message */
+	pthread_mutex_unlock(&o->lock);
+}
+
+/* Sleep for seconds, or until the output is stopped */
+static void output_wait(output_t *o, unsigned long seconds)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += seconds;
+	pthread_mutex_lock(&o->lock);
+	while (!o->stop && pthread_cond_timedwait(&o->cond, &o->lock, &ts) != ETIMEDOUT)
+		;
+	pthread_mutex_unlock(&o->lock);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Syslog output
+ * Instead of one syslog() call (and one sendto()) per message, messages are formatted like syslog() does (without
+ * LOG_PID) and sent on our own connection to SYSLOG_PATH, up to syslog_batch_size datagrams per sendmmsg() call.
+ * If SYSLOG_PATH can't be used, or syslog_batch_size is 0, messages go through syslog() as before.
+ */
+struct slog_state {
+	int fd;
+	int failed;
+	time_t last;
+	int header_len;
+	char header[SYSLOG_HEADER_LEN];
+	struct mmsghdr msgs[MAX_SYSLOG_BATCH];
+	struct iovec iov[MAX_SYSLOG_BATCH][2];
+};
+
+static int slog_connect(struct slog_state *st)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SYSLOG_PATH, sizeof(addr.sun_path)-1);
+
+	st->fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if (st->fd < 0)
+		return -1;
+	if (connect(st->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(st->fd);
+		st->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void syslog_send(output_t *o, queue_t *list, unsigned int count)
+{
+	struct slog_state *st = o->state;
+	struct tm tm;
+	time_t now;
+	queue_t *q;
+	unsigned int i, sent = 0;
+	int ret, retried = 0;
+
+	if (o->conf.syslog_batch_size == 0 || st->failed || (st->fd < 0 && slog_connect(st)))
+		goto fallback;
+
+	now = time(NULL);
+	if (now != st->last) {
+		st->last = now;
+		localtime_r(&now, &tm);
+		st->header_len = snprintf(st->header, SYSLOG_HEADER_LEN, "<%d>", LOG_AUTHPRIV|LOG_INFO);
+		st->header_len += strftime(st->header+st->header_len, SYSLOG_HEADER_LEN-st->header_len, "%h %e %T ", &tm);
+		st->header_len += snprintf(st->header+st->header_len, SYSLOG_HEADER_LEN-st->header_len, "%s: ",
+				PROGRAM_NAME);
+	}
+
+	for (q = list, i = 0; q; q = q->next, i++) {
+		st->iov[i][0].iov_base = st->header;
+		st->iov[i][0].iov_len = st->header_len;
+		st->iov[i][1].iov_base = q->msg->val;
+		st->iov[i][1].iov_len = q->msg->len;
+		memset(&st->msgs[i], 0, sizeof(struct mmsghdr));
+		st->msgs[i].msg_hdr.msg_iov = st->iov[i];
+		st->msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	while (sent < count) {
+		ret = sendmmsg(st->fd, st->msgs+sent, count-sent, 0);
+		if (ret > 0) {
+			sent += ret;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		/* syslog daemon restarted? */
+		if (!retried) {
+			retried = 1;
+			close(st->fd);
+			if (slog_connect(st) == 0)
+				continue;
+		}
+		st->failed = 1;
+		break;
+	}
+	TRACE(syslog_flush, count, sent);
+
+fallback:
+	for (q = list, i = 0; q; q = q->next, i++) {
+		if (i >= sent)
+			syslog(LOG_INFO, "%s", q->msg->val);
+	}
+	queue_free(list);
+}
+
+static void syslog_close(output_t *o)
+{
+	struct slog_state *st = o->state;
+
+	if (st->fd >= 0)
+		close(st->fd);
+	st->fd = -1;
+}
+
+/*
+ * Compressed local archive output
+ * Messages are appended to gzip compressed segments in archive_dir. Each segment is made of independent gzip members
+ * ("frames") of about archive_frame_size uncompressed bytes so that it can be read from any frame start without
+ * decompressing what precedes it, while zcat still reads the whole segment. For each frame a
+ * "<first serial> <first timestamp> <offset>" line is appended to the segment's .idx file.
+ * Segments are rotated after archive_max_size compressed bytes or archive_rotate_interval seconds, and are fdatasync'd
+ * every archive_sync_frames frames (0 disables syncing). A frame is closed after archive_flush_interval seconds (wall
+ * clock) even if no other message arrives, the frames not synced yet are then synced too.
+ */
+struct archive_state {
+	int fd;
+	int idx_fd;
+	int in_frame;
+	int zinit;
+	z_stream zs;
+	unsigned long offset;		/* compressed bytes in the segment */
+	unsigned long frame_size;	/* uncompressed bytes in the frame */
+	unsigned long frames;		/* frames since the last sync */
+	time_t segment_start;
+	time_t frame_start;		/* wall clock, not event time */
+	unsigned char out[ARCHIVE_BUF_SIZE];
+};
+
+static void archive_close_segment(output_t *o);
+
+static int archive_open_segment(output_t *o, unsigned long serial, time_t t)
+{
+	struct archive_state *st = o->state;
+	char path[PATH_MAX];
+	char ts[32];
+	struct tm tm;
+	int len;
+
+	strftime(ts, sizeof(ts), "%Y%m%dT%H%M%S", gmtime_r(&t, &tm));
+	len = snprintf(path, sizeof(path), "%s/audit-%s-%lu.json.gz", o->conf.archive_dir, ts, serial);
+	if (len >= sizeof(path) - 4) {
+		syslog(LOG_ERR, "archive path too long: %s", o->conf.archive_dir);
+		return -1;
+	}
+
+	st->fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_APPEND|O_CLOEXEC, 0600);
+	if (st->fd < 0) {
+		syslog(LOG_ERR, "could not create archive segment %s: %s", path, strerror(errno));
+		return -1;
+	}
+	snprintf(path+len, sizeof(path)-len, ".idx");
+	st->idx_fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_APPEND|O_CLOEXEC, 0600);
+	if (st->idx_fd < 0) {
+		syslog(LOG_ERR, "could not create archive index %s: %s", path, strerror(errno));
+		close(st->fd);
+		st->fd = -1;
+		return -1;
+	}
+
+	if (!st->zinit) {
+		memset(&st->zs, 0, sizeof(z_stream));
+		/* 15+16: gzip wrapper */
+		if (deflateInit2(&st->zs, o->conf.archive_compress_level, Z_DEFLATED, 15+16, 8,
+					Z_DEFAULT_STRATEGY) != Z_OK) {
+			syslog(LOG_ERR, "archive deflateInit2() failed");
+			archive_close_segment(o);
+			return -1;
+		}
+		st->zinit = 1;
+	}
+
+	st->offset = 0;
+	st->frames = 0;
+	st->in_frame = 0;
+	st->segment_start = t;
+	return 0;
+}
+
+/* Run deflate() over the pending input and write the output to the segment */
+static int archive_deflate(struct archive_state *st, int flush)
+{
+	size_t have;
+	int ret;
+
+	do {
+		st->zs.next_out = st->out;
+		st->zs.avail_out = ARCHIVE_BUF_SIZE;
+		ret = deflate(&st->zs, flush);
+		if (ret == Z_STREAM_ERROR)
+			return -1;
+		have = ARCHIVE_BUF_SIZE - st->zs.avail_out;
+		if (have && write_all(st->fd, st->out, have))
+			return -1;
+		st->offset += have;
+	} while (st->zs.avail_out == 0);
+
+	return 0;
+}
+
+static int archive_close_frame(output_t *o)
+{
+	struct archive_state *st = o->state;
+
+	if (!st->in_frame)
+		return 0;
+
+	st->in_frame = 0;
+	if (archive_deflate(st, Z_FINISH))
+		return -1;
+	deflateReset(&st->zs);
+
+	if (o->conf.archive_sync_frames && ++st->frames >= o->conf.archive_sync_frames) {
+		st->frames = 0;
+		if (fdatasync(st->fd) || fdatasync(st->idx_fd))
+			return -1;
+	}
+	return 0;
+}
+
+static void archive_close_segment(output_t *o)
+{
+	struct archive_state *st = o->state;
+
+	if (st->fd >= 0) {
+		if (archive_close_frame(o))
+			syslog(LOG_ERR, "archive segment could not be completed: %s", strerror(errno));
+		if (o->conf.archive_sync_frames && st->frames)
+			fdatasync(st->fd);
+		close(st->fd);
+		st->fd = -1;
+	}
+	if (st->idx_fd >= 0) {
+		close(st->idx_fd);
+		st->idx_fd = -1;
+	}
+	if (st->zinit) {
+		deflateEnd(&st->zs);
+		st->zinit = 0;
+	}
+}
+
+/* Append msg (and a LF) to the archive */
+static void archive_write(output_t *o, const char *msg, size_t len, unsigned long serial, time_t t)
+{
+	struct archive_state *st = o->state;
+	char idx[96];
+	int idxlen;
+
+	if (st->fd < 0 && archive_open_segment(o, serial, t))
+		return;
+
+	if (!st->in_frame) {
+		idxlen = snprintf(idx, sizeof(idx), "%lu %ld %lu\n", serial, (long)t, st->offset);
+		if (write_all(st->idx_fd, idx, idxlen))
+			goto err;
+		st->in_frame = 1;
+		st->frame_size = 0;
+		st->frame_start = time(NULL);
+	}
+
+	st->zs.next_in = (unsigned char *)msg;
+	st->zs.avail_in = len;
+	if (archive_deflate(st, Z_NO_FLUSH))
+		goto err;
+	st->zs.next_in = (unsigned char *)"\n";
+	st->zs.avail_in = 1;
+	if (archive_deflate(st, Z_NO_FLUSH))
+		goto err;
+	st->frame_size += len + 1;
+
+	TRACE(archive_write, serial, len);
+
+	if (st->frame_size >= o->conf.archive_frame_size ||
+			time(NULL) - st->frame_start >= o->conf.archive_flush_interval) {
+		if (archive_close_frame(o))
+			goto err;
+	}
+
+	if (st->offset >= o->conf.archive_max_size ||
+			(o->conf.archive_rotate_interval && t - st->segment_start >= o->conf.archive_rotate_interval))
+		archive_close_segment(o);
+
+	return;
+
+err:
+	syslog(LOG_ERR, "archive write failed, closing segment: %s", strerror(errno));
+	archive_close_segment(o);
+}
+
+/* Time at which the open frame is to be closed if no message arrives, 0 if there is none */
+static time_t archive_flush_deadline(output_t *o)
+{
+	struct archive_state *st = o->state;
+
+	if (st->fd < 0 || !st->in_frame)
+		return 0;
+	return st->frame_start + o->conf.archive_flush_interval;
+}
+
+/* Close the open frame once archive_flush_interval is over and sync it, from the output thread when it is idle */
+static void archive_flush(output_t *o)
+{
+	struct archive_state *st = o->state;
+	time_t deadline = archive_flush_deadline(o);
+
+	if (!deadline || time(NULL) < deadline)
+		return;
+	if (archive_close_frame(o))
+		goto err;
+	if (o->conf.archive_sync_frames && st->frames) {
+		st->frames = 0;
+		if (fdatasync(st->fd) || fdatasync(st->idx_fd))
+			goto err;
+	}
+	return;
+
+err:
+	syslog(LOG_ERR, "archive write failed, closing segment: %s", strerror(errno));
+	archive_close_segment(o);
+}
+
+static void archive_send(output_t *o, queue_t *list, unsigned int count)
+{
+	queue_t *q;
+
+	for (q = list; q; q = q->next)
+		archive_write(o, q->msg->val, q->msg->len, q->msg->serial, q->msg->time);
+	queue_free(list);
+}
+
+/*
+ * GELF over HTTP output
+ * Messages are sent in their GELF flavor (audit fields become "_audit_<name>" additional fields).
+ * The output thread keeps one persistent connection and sends newline delimited batches of up to http_batch_size
+ * messages per POST request (this requires "bulk receiving" on the Graylog GELF HTTP input), optionally gzip
+ * compressed. Up to http_pipeline requests are written before reading their responses. Batches which were not
+ * acknowledged with a 2xx status are put back at the head of the queue and retried with an exponential backoff capped
+ * to http_retry_max_backoff seconds. A batch whose response was lost may thus be delivered twice.
+ */
+typedef struct {
+	queue_t *head;		/* batch messages, in order */
+	queue_t *tail;
+	unsigned int count;
+	size_t size;
+	int acked;
+	char *body;
+	size_t body_len;
+	char header[HTTP_HEADER_SIZE];
+	size_t header_len;
+} http_batch_t;
+
+struct http_state {
+	int fd;
+	unsigned long backoff;
+	char rbuf[HTTP_RBUF_SIZE];
+	size_t rlen;
+	size_t rpos;
+	http_batch_t batches[HTTP_MAX_PIPELINE];
+};
+
+static void http_disconnect(struct http_state *st)
+{
+	if (st->fd >= 0) {
+		close(st->fd);
+		st->fd = -1;
+	}
+	st->rlen = st->rpos = 0;
+}
+
+static int http_connect(output_t *o)
+{
+	struct http_state *st = o->state;
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv;
+	char port[8];
+	int one = 1;
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%lu", o->conf.http_port);
+
+	ret = getaddrinfo(o->conf.http_host, port, &hints, &res);
+	if (ret) {
+		syslog(LOG_ERR, "could not resolve %s: %s", o->conf.http_host, gai_strerror(ret));
+		return -1;
+	}
+
+	tv.tv_sec = o->conf.http_timeout;
+	tv.tv_usec = 0;
+	for (ai = res; ai; ai = ai->ai_next) {
+		st->fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC, ai->ai_protocol);
+		if (st->fd < 0)
+			continue;
+		setsockopt(st->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		setsockopt(st->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		setsockopt(st->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if (connect(st->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(st->fd);
+		st->fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (st->fd < 0) {
+		syslog(LOG_ERR, "could not connect to %s:%lu: %s", o->conf.http_host, o->conf.http_port, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Gzip src into a malloc'd buffer */
+static char *http_gzip(const char *src, size_t len, size_t *outlen)
+{
+	z_stream zs;
+	char *out;
+	size_t bound;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+	/* deflateBound() does not account for the gzip header/trailer */
+	bound = deflateBound(&zs, len) + 18;
+	out = malloc(bound);
+	if (!out) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+	zs.next_in = (unsigned char *)src;
+	zs.avail_in = len;
+	zs.next_out = (unsigned char *)out;
+	zs.avail_out = bound;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		free(out);
+		return NULL;
+	}
+	*outlen = zs.total_out;
+	deflateEnd(&zs);
+	return out;
+}
+
+/* Build the request body and header of a batch */
+static int http_prepare(output_t *o, http_batch_t *b)
+{
+	queue_t *q;
+	char *body, *gz;
+	size_t len = 0;
+
+	body = malloc(b->size);
+	if (!body)
+		return -1;
+	for (q = b->head; q; q = q->next) {
+		memcpy(body+len, q->msg->gelf, q->msg->gelf_len);
+		len += q->msg->gelf_len;
+		body[len++] = '\n';
+	}
+
+	if (o->conf.http_compress) {
+		gz = http_gzip(body, len, &len);
+		free(body);
+		if (!gz)
+			return -1;
+		body = gz;
+	}
+
+	b->body = body;
+	b->body_len = len;
+	b->header_len = snprintf(b->header, HTTP_HEADER_SIZE,
+			"POST %s HTTP/1.1\r\nHost: %s:%lu\r\nContent-Type: application/json\r\n%s"
+			"Content-Length: %zu\r\nConnection: keep-alive\r\n\r\n",
+			o->conf.http_path ? o->conf.http_path : "/gelf", o->conf.http_host, o->conf.http_port,
+			o->conf.http_compress ? "Content-Encoding: gzip\r\n" : "", len);
+	if (b->header_len >= HTTP_HEADER_SIZE)
+		return -1;
+	return 0;
+}
+
+static int http_writev(struct http_state *st, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		ret = writev(st->fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/* Read one line (CRLF stripped) of a response into line */
+static int http_readline(struct http_state *st, char *line, size_t size)
+{
+	size_t i = 0;
+	ssize_t ret;
+	char c;
+
+	for (;;) {
+		if (st->rpos == st->rlen) {
+			ret = read(st->fd, st->rbuf, HTTP_RBUF_SIZE);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				return -1;
+			st->rlen = ret;
+			st->rpos = 0;
+		}
+		c = st->rbuf[st->rpos++];
+		if (c == '\n')
+			break;
+		if (c != '\r' && i < size-1)
+			line[i++] = c;
+	}
+	line[i] = '\0';
+	return 0;
+}
+
+/* Skip len bytes of response body */
+static int http_skip(struct http_state *st, size_t len)
+{
+	size_t n;
+	ssize_t ret;
+
+	while (len > 0) {
+		if (st->rpos == st->rlen) {
+			ret = read(st->fd, st->rbuf, HTTP_RBUF_SIZE);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				return -1;
+			st->rlen = ret;
+			st->rpos = 0;
+		}
+		n = st->rlen - st->rpos;
+		if (n > len)
+			n = len;
+		st->rpos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Read a response, returning its status code or -1. *keepalive is cleared if the server closes the connection. */
+static int http_read_response(struct http_state *st, int *keepalive)
+{
+	char line[512];
+	size_t clen = 0;
+	int status;
+
+	if (http_readline(st, line, sizeof(line)) || sscanf(line, "HTTP/%*d.%*d %d", &status) != 1)
+		return -1;
+
+	for (;;) {
+		if (http_readline(st, line, sizeof(line)))
+			return -1;
+		if (line[0] == '\0')
+			break;
+		if (!strncasecmp(line, "Content-Length:", 15))
+			clen = strtoul(line+15, NULL, 10);
+		else if (!strncasecmp(line, "Connection:", 11) && strcasestr(line+11, "close"))
+			*keepalive = 0;
+		else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strcasestr(line+18, "chunked"))
+			/* we don't need the body, chunked ones are simply not kept alive */
+			*keepalive = 0;
+	}
+
+	if (clen && http_skip(st, clen))
+		return -1;
+	return status;
+}
+
+/* Send n batches on the persistent connection, setting their acked flag
+ * Returns the number of batches which were acknowledged.
+ */
+static int http_send(output_t *o, http_batch_t *batches, int n)
+{
+	struct http_state *st = o->state;
+	struct iovec iov[2];
+	int i, written, acked = 0, status, keepalive = 1, ok = 1;
+
+	if (st->fd < 0 && http_connect(o))
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		iov[0].iov_base = batches[i].header;
+		iov[0].iov_len = batches[i].header_len;
+		iov[1].iov_base = batches[i].body;
+		iov[1].iov_len = batches[i].body_len;
+		if (http_writev(st, iov, 2)) {
+			syslog(LOG_ERR, "HTTP write to %s failed: %s", o->conf.http_host, strerror(errno));
+			break;
+		}
+	}
+	written = i;
+
+	for (i = 0; i < written && keepalive; i++) {
+		status = http_read_response(st, &keepalive);
+		if (status < 0) {
+			syslog(LOG_ERR, "HTTP read from %s failed", o->conf.http_host);
+			ok = 0;
+			break;
+		}
+		if (status < 200 || status > 299) {
+			syslog(LOG_ERR, "HTTP server %s replied with status %d", o->conf.http_host, status);
+			continue;
+		}
+		batches[i].acked = 1;
+		acked++;
+	}
+
+	/* a partly written request or any unread response would be mismatched with the next request */
+	if (!ok || i < written || written < n || !keepalive)
+		http_disconnect(st);
+	TRACE(http_sent, written, acked);
+	return acked;
+}
+
+static void http_send_list(output_t *o, queue_t *list, unsigned int count, int stopping)
+{
+	struct http_state *st = o->state;
+	http_batch_t *b;
+	queue_t *q;
+	unsigned long lost = 0;
+	int n, i, acked;
+
+	/* split the list in up to http_pipeline batches */
+	for (n = 0; n < o->conf.http_pipeline && list; n++) {
+		b = &st->batches[n];
+		memset(b, 0, sizeof(http_batch_t));
+		while (list && b->count < o->conf.http_batch_size) {
+			q = list;
+			list = q->next;
+			q->next = NULL;
+			if (b->tail)
+				b->tail->next = q;
+			else
+				b->head = q;
+			b->tail = q;
+			b->count++;
+			b->size += q->msg->gelf_len + 1;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (http_prepare(o, &st->batches[i])) {
+			syslog(LOG_ERR, "could not prepare HTTP request");
+			break;
+		}
+	}
+	acked = http_send(o, st->batches, i);
+
+	for (i = 0; i < n; i++) {
+		free(st->batches[i].body);
+		if (st->batches[i].acked)
+			queue_free(st->batches[i].head);
+	}
+
+	if (acked == n) {
+		st->backoff = 0;
+		return;
+	}
+
+	if (stopping) {
+		for (i = 0; i < n; i++) {
+			if (st->batches[i].acked)
+				continue;
+			lost += st->batches[i].count;
+			queue_free(st->batches[i].head);
+		}
+		/* don't wait for a timeout per batch on the way out */
+		pthread_mutex_lock(&o->lock);
+		lost += o->size;
+		list = o->head;
+		o->head = o->tail = NULL;
+		o->size = 0;
+		o->lost = 1;
+		pthread_mutex_unlock(&o->lock);
+		queue_free(list);
+		syslog(LOG_ERR, "output %s stopping, %lu messages not sent", o->name, lost);
+		return;
+	}
+
+	/* put the unacknowledged batches back at the head of the queue, in order */
+	for (i = n-1; i >= 0; i--) {
+		b = &st->batches[i];
+		if (!b->acked)
+			output_requeue(o, b->head, b->tail, b->count);
+	}
+
+	st->backoff = st->backoff ? st->backoff*2 : 1;
+	if (st->backoff > o->conf.http_retry_max_backoff)
+		st->backoff = o->conf.http_retry_max_backoff;
+	output_wait(o, st->backoff);
+}
+
+/* Maximum number of messages taken off the queue at once */
+static unsigned int output_batch_max(output_t *o)
+{
+	switch (o->type) {
+		case OUTPUT_SYSLOG:
+			return o->conf.syslog_batch_size ? o->conf.syslog_batch_size : 1;
+		case OUTPUT_HTTP:
+			return o->conf.http_pipeline * o->conf.http_batch_size;
+		default:
+			return o->conf.queue_size;
+	}
+}
+
+static int conf_strcmp(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a != b;
+	return strcmp(a, b);
+}
+
+/* Called from the output thread once o->conf has been replaced by a reload, closes what depends on the old settings */
+static void output_reconfigured(output_t *o, const struct output_conf *prev)
+{
+	switch (o->type) {
+		case OUTPUT_ARCHIVE:
+			/* the next message starts a segment with the new settings */
+			if (conf_strcmp(prev->archive_dir, o->conf.archive_dir) ||
+					prev->archive_compress_level != o->conf.archive_compress_level)
+				archive_close_segment(o);
+			break;
+		case OUTPUT_HTTP:
+			if (conf_strcmp(prev->http_host, o->conf.http_host) || conf_strcmp(prev->http_path, o->conf.http_path) ||
+					prev->http_port != o->conf.http_port || prev->http_compress != o->conf.http_compress ||
+					prev->http_timeout != o->conf.http_timeout)
+				http_disconnect(o->state);
+			break;
+		default:
+			break;
 	}
-	sorted_tmp[0] = '\0';
-	full_str_tmp[0] = '\0';
-#endif
+	syslog(LOG_INFO, "output %s reconfigured", o->name);
+}
 
-	auparse_add_callback(au, handle_event, NULL, NULL);
-	syslog(LOG_INFO, "%s loaded\n", PROGRAM_NAME);
+static void *output_thread_main(void *arg)
+{
+	output_t *o = arg;
+	struct output_conf prev = { 0 }, *pending;
+	struct timespec deadline;
+	queue_t *list, *tail;
+	unsigned long dropped;
+	unsigned int count, max;
+	int stopping;
 
-	/* At this point we're initialized so we'll read stdin until closed and feed the data to auparse, which in turn will
-	 * call our callback (handle_event) every time it finds a new complete message to parse.
-	 */
-	do {
-		/* NOTE: There's quite a few reasons for auparse_feed() from libaudit to fail parsing silently so we have to be careful here.
-		 * Anything passed to it:
-		 * - must have the same timestamp for a given event id. (kernel takes care of that, if not, you're out of luck).
-		 * - must always be LF+NULL terminated ("\n\0"). (fgets takes care of that even thus it's not nearly as fast as fread).
-		 * - must always have event ids in sequential order. (REORDER_HACK takes care of that, it also buffer lines, since, well, it needs to).
-		 */
-		while (fgets_unlocked(tmp, MAX_AUDIT_MESSAGE_LENGTH, stdin)) {
-			if (sig_stop)
+	max = output_batch_max(o);
+
+	for (;;) {
+		pthread_mutex_lock(&o->lock);
+		while (!o->head && !o->stop && !o->pending) {
+			/* an open archive frame is closed on time even if no message comes */
+			deadline.tv_sec = o->type == OUTPUT_ARCHIVE ? archive_flush_deadline(o) : 0;
+			deadline.tv_nsec = 0;
+			if (!deadline.tv_sec)
+				pthread_cond_wait(&o->cond, &o->lock);
+			else if (pthread_cond_timedwait(&o->cond, &o->lock, &deadline) == ETIMEDOUT)
 				break;
+		}
+		stopping = o->stop;
+		dropped = o->dropped;
+		o->dropped = 0;
+		/* o->conf is only written here, under o->lock which output_enqueue() holds to read it */
+		pending = o->pending;
+		if (pending) {
+			prev = o->conf;
+			o->conf = *pending;
+			o->pending = NULL;
+			max = output_batch_max(o);
+		}
 
-			len = strnlen(tmp, MAX_AUDIT_MESSAGE_LENGTH);
-#ifdef REORDER_HACK
-			if (strncmp(tmp, "type=EOE", 8) == 0) {
-				stop++;
-			} else if (strncmp(tmp, "type=SYSCALL", 12) == 0) {
-				start++;
-			}
-			if (i > NR_LINES_BUFFERED || start != stop) {
-				strncat(full_str_tmp, tmp, len);
-				i++;
-			} else {
-				strncat(full_str_tmp, tmp, len);
-				len = reorder_input_hack(&sorted_tmp, full_str_tmp);
-				auparse_feed(au, sorted_tmp, len);
-				i = 0;
-				start = stop = 0;
-				sorted_tmp[0] = '\0';
-				full_str_tmp[0] = '\0';
+		/* take up to max messages off the queue */
+		list = tail = o->head;
+		count = 0;
+		while (tail) {
+			o->head = tail->next;
+			if (++count == max || !o->head) {
+				tail->next = NULL;
+				break;
 			}
-#else
-			auparse_feed(au, tmp, len);
-#endif
+			tail = o->head;
+		}
+		if (!o->head)
+			o->tail = NULL;
+		o->size -= count;
+		if (count) {
+			o->unsent = 1;
+			o->unsent_after = list->msg->after;
+			output_oldest_update(o);
 		}
+		pthread_mutex_unlock(&o->lock);
 
-		if (feof(stdin))
-			break;
-	} while (sig_stop == 0);
+		if (dropped)
+			syslog(LOG_ERR, "output %s queue full, %lu messages lost!", o->name, dropped);
+		if (pending) {
+			output_reconfigured(o, &prev);
+			output_conf_free(&prev);
+			free(pending);
+		}
+		if (count == 0) {
+			if (stopping)
+				break;
+			if (o->type == OUTPUT_ARCHIVE)
+				archive_flush(o);
+			continue;
+		}
 
-	auparse_flush_feed(au);
-	auparse_destroy(au);
-	free(hostname);
-#ifdef REORDER_HACK
-	free(sorted_tmp);
-#endif
-	syslog(LOG_INFO, "%s unloaded\n", PROGRAM_NAME);
-	closelog();
+		switch (o->type) {
+			case OUTPUT_SYSLOG:
+				syslog_send(o, list, count);
+				break;
+			case OUTPUT_ARCHIVE:
+				archive_send(o, list, count);
+				break;
+			case OUTPUT_HTTP:
+				http_send_list(o, list, count, stopping);
+				break;
+			default:
+				queue_free(list);
+				break;
+		}
 
-	return 0;
+		/* sent, dropped or requeued */
+		pthread_mutex_lock(&o->lock);
+		o->unsent = o->lost;
+		output_oldest_update(o);
+		pthread_mutex_unlock(&o->lock);
+	}
+
+	switch (o->type) {
+		case OUTPUT_SYSLOG:
+			syslog_close(o);
+			break;
+		case OUTPUT_ARCHIVE:
+			archive_close_segment(o);
+			break;
+		case OUTPUT_HTTP:
+			http_disconnect(o->state);
+			break;
+		default:
+			break;
+	}
+	return NULL;
 }
 
-/*
- * This function seeks to the specified record returning its type on succees
- */
-static int goto_record_type(auparse_state_t *au, int type)
+static int output_start(output_t *o)
 {
-	int cur_type;
+	sigset_t all, old;
+	int ret;
 
-	auparse_first_record(au);
-	do {
-		cur_type = auparse_get_type(au);
-		if (cur_type == type) {
-			auparse_first_field(au);
-			return type;  // Normal exit
-		}
-	} while (auparse_next_record(au) > 0);
+	switch (o->type) {
+		case OUTPUT_SYSLOG:
+			o->state = calloc(1, sizeof(struct slog_state));
+			if (o->state)
+				((struct slog_state *)o->state)->fd = -1;
+			break;
+		case OUTPUT_ARCHIVE:
+			o->state = calloc(1, sizeof(struct archive_state));
+			if (o->state)
+				((struct archive_state *)o->state)->fd = ((struct archive_state *)o->state)->idx_fd = -1;
+			break;
+		case OUTPUT_HTTP:
+			o->state = calloc(1, sizeof(struct http_state));
+			if (o->state)
+				((struct http_state *)o->state)->fd = -1;
+			break;
+		default:
+			break;
+	}
+	if (!o->state) {
+		syslog(LOG_ERR, "output_start() calloc failed for output %s", o->name);
+		return -1;
+	}
 
-	return -1;
+	/* signals are for the main thread, see main() */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&o->thread, NULL, output_thread_main, o);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		syslog(LOG_ERR, "could not create the thread of output %s: %s", o->name, strerror(ret));
+		return -1;
+	}
+	o->started = 1;
+	return 0;
 }
 
-/* Removes quotes
- * Remove  CR and LF
- * @const char *in: if NULL, no processing is done.
- */
-char *unescape(const char *in)
+int output_start_all(void)
 {
-	if (in == NULL)
-		return NULL;
+	output_t *o;
 
-	char *dst = (char *)in;
-	char *s = dst;
-	char *src = (char *)in;
-	char c;
+	for (o = config->outputs; o; o = o->next) {
+		if (output_start(o))
+			return -1;
+	}
+	return 0;
+}
 
-	while ((c = *src++) != '\0') {
-		if ((c == '"') || (c == '\n') || (c == '\r') || (c == '\t')
-				|| (c == '\b') || (c == '\f') || (c == '\\'))
+/* Stop the output threads once their queues are flushed (with a single attempt for HTTP outputs) */
+static void outputs_stop(output_t *list)
+{
+	output_t *o;
+
+	for (o = list; o; o = o->next) {
+		if (!o->started)
 			continue;
-		*dst++ = c;
+		pthread_mutex_lock(&o->lock);
+		o->stop = 1;
+		pthread_cond_signal(&o->cond);
+		pthread_mutex_unlock(&o->lock);
+	}
+	for (o = list; o; o = o->next) {
+		if (!o->started)
+			continue;
+		pthread_join(o->thread, NULL);
+		o->started = 0;
+		free(o->state);
+		o->state = NULL;
 	}
-	*dst++ = '\0';
-	return s;
 }
 
-/* Add a field to the json msg's details={}
- * @attr_t *list: the attribute list to extend
- * @const char *st: the attribute name to add
- * @const char *val: the attribut value - if NULL, we won't add the field to the json message at all.
+void output_stop_all(void)
+{
+	outputs_stop(config->outputs);
+}
+
+/*
+ * Configuration reload
+ * SIGHUP makes the main loop start a thread which loads and validates the configuration file again and starts the
+ * outputs it adds, while events keep being handled with the current configuration. An invalid file is rejected and
+ * the current configuration stays in use. Otherwise the main loop swaps the config pointer between two chunks of
+ * input. Outputs with the same name and type as a running one keep their thread, queue and connection, their new
+ * settings are handed over to their thread. The replaced configuration is then freed by another thread, which first
+ * stops the outputs that were removed (their queue is flushed like on exit). The process table, sessions, checkpoint
+ * and hostname are kept; checkpoint_file, catchup and catchup_log changes need a restart.
  */
-attr_t *_json_add_attr(attr_t *list, const char *st, char *val, int freeme)
+static pthread_t reload_thread;
+static int reload_done = 0;
+static struct plugin_conf *reload_config = NULL;
+
+static void *reload_prepare_main(void *arg)
 {
-	attr_t *new;
+	struct plugin_conf *c;
+	output_t *o, *old;
+	int rc = 0;
 
-	if (st == NULL || !strncmp(st, "(null)", 6) || val == NULL || !strncmp(val, "(null)", 6)) {
-		return list;
+	c = calloc(1, sizeof(struct plugin_conf));
+	if (!c) {
+		syslog(LOG_ERR, "reload_prepare_main() calloc failed, keeping the current configuration");
+		goto done;
 	}
-
-	new = malloc(sizeof(attr_t));
-	if (!new) {
-		syslog(LOG_ERR, "json_add_attr() malloc failed attribute will be empty: %s", st);
-		return list;
+	if (load_config(config_path, c, config_required)) {
+		syslog(LOG_ERR, "invalid configuration in %s, keeping the current one", config_path);
+		rc = -1;
 	}
-	snprintf(new->value, MAX_ATTR_SIZE, "\"%s\":\"%s\"", st, unescape(val));
-	new->next = list;
 
-	if (freeme) {
-		free(val);
+	/* config is only replaced by the main thread once this thread is done */
+	for (o = c->outputs; o && rc == 0; o = o->next) {
+		old = output_find(config, o->name);
+		if (old && old->type == o->type) {
+			o->replaces = old;
+			old->kept = 1;
+		} else if (output_start(o)) {
+			syslog(LOG_ERR, "could not start output %s, keeping the current configuration", o->name);
+			rc = -1;
+		}
 	}
 
-	return new;
+	if (rc) {
+		for (o = c->outputs; o; o = o->next) {
+			if (o->replaces)
+				o->replaces->kept = 0;
+		}
+		outputs_stop(c->outputs);
+		free_config(c);
+		free(c);
+		goto done;
+	}
+	reload_config = c;
+done:
+	__atomic_store_n(&reload_done, 1, __ATOMIC_RELEASE);
+	return NULL;
 }
 
-/* Convenience wrappers for _json_add_attr */
-attr_t *json_add_attr_free(attr_t *list, const char *st, char *val)
+static void *reload_retire_main(void *arg)
 {
-	return _json_add_attr(list, st, val, 1);
+	struct plugin_conf *c = arg;
+
+	outputs_stop(c->outputs);
+	free_config(c);
+	free(c);
+	__atomic_store_n(&reload_done, 1, __ATOMIC_RELEASE);
+	return NULL;
 }
 
-attr_t *json_add_attr(attr_t *list, const char *st, const char *val)
+static int reload_start_thread(void *(*fn)(void *), void *arg)
 {
-	return _json_add_attr(list, st, (char *)val, 0);
+	sigset_t all, old;
+	int ret;
+
+	reload_done = 0;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&reload_thread, NULL, fn, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret)
+		syslog(LOG_ERR, "could not create the configuration reload thread: %s", strerror(ret));
+	return ret;
 }
 
-void json_del_attrs(attr_t *head)
+/* Hand the new settings of n over to the running output o, which takes its place in the new configuration */
+static void reload_adopt(output_t *o, output_t *n)
 {
-	attr_t *prev;
-	while (head) {
-		prev = head;
-		head = head->next;
-		free(prev);
+	struct output_conf *pending;
+
+	o->id = n->id;
+	o->kept = 0;
+	pending = malloc(sizeof(struct output_conf));
+	if (!pending) {
+		syslog(LOG_ERR, "reload_adopt() malloc failed, output %s keeps its settings", o->name);
+		return;
+	}
+	*pending = n->conf;
+	memset(&n->conf, 0, sizeof(struct output_conf));
+
+	pthread_mutex_lock(&o->lock);
+	if (o->pending) {
+		output_conf_free(o->pending);
+		free(o->pending);
 	}
+	o->pending = pending;
+	pthread_cond_signal(&o->cond);
+	pthread_mutex_unlock(&o->lock);
 }
 
-/* Resolve uid to username - returns malloc'd value */
-char *get_username(int uid)
+/* Swap reload_config in, from the main thread between events */
+static void reload_swap(void)
 {
-	size_t bufsize;
-	char *buf;
-	char *name;
-	struct passwd pwd;
-	struct passwd *result;
+	struct plugin_conf *c = reload_config, *old = config;
+	output_t *o, *n, *next, **pp, *retired = NULL;
 
-	bufsize = sysconf(_SC_GETPW_R_SIZE_MAX);
-	if (bufsize == -1)
-		bufsize = 16384;
-	buf = (char *)alloca(bufsize);
-	if (!buf) {
-		return NULL;
-	}
+	reload_config = NULL;
 
-	if (uid == -1) {
-		return NULL;
+	/* the catch-up thread walks config->outputs with event_lock held, relink and swap in one go */
+	pthread_mutex_lock(&event_lock);
+
+	/* what isn't kept from the old configuration is retired */
+	for (o = old->outputs; o; o = next) {
+		next = o->next;
+		if (o->kept)
+			continue;
+		o->next = retired;
+		retired = o;
 	}
-	if (getpwuid_r(uid, &pwd, buf, bufsize, &result) != 0) {
-		return NULL;
+	/* running outputs take the place of their new definitions, which are retired instead */
+	for (pp = &c->outputs; *pp; pp = &(*pp)->next) {
+		n = *pp;
+		if (!n->replaces)
+			continue;
+		o = n->replaces;
+		n->replaces = NULL;
+		reload_adopt(o, n);
+		o->next = n->next;
+		*pp = o;
+		n->next = retired;
+		retired = n;
 	}
-	if (result == NULL) {
-		return NULL;
+	old->outputs = retired;
+	config = c;
+	pthread_mutex_unlock(&event_lock);
+
+	if (config->session_tracking == SESSION_OFF)
+		session_close_all();
+	syslog(LOG_INFO, "configuration reloaded from %s", config_path);
+
+	if (reload_start_thread(reload_retire_main, old)) {
+		/* better stall once than leak running outputs */
+		reload_retire_main(old);
+		reload_state = RELOAD_IDLE;
+		return;
 	}
-	name = strdup(pwd.pw_name);
-	return name;
+	reload_state = RELOAD_RETIRING;
 }
 
-/* Resolve process name from pid */
-char *get_proc_name(int pid)
+/* Advance the reload started by SIGHUP, if any
+ * @int wait: wait for the reload threads instead of checking whether they are done
+ */
+void reload_poll(int wait)
 {
-	char p[1024];
-	int ret;
-	static char proc[64];
-	FILE *fp;
-	snprintf(p, 512, "/proc/%d/status", pid);
-	fp = fopen(p, "r");
-	if (fp) {
-		ret = fscanf(fp, "Name: %63s", proc);
-		fclose(fp);
-	} else
-		return NULL;
+	switch (reload_state) {
+		case RELOAD_IDLE:
+			if (!sig_reload)
+				return;
+			sig_reload = 0;
+			if (reload_start_thread(reload_prepare_main, NULL) == 0)
+				reload_state = RELOAD_PREPARING;
+			break;
+		case RELOAD_PREPARING:
+			if (!wait && !__atomic_load_n(&reload_done, __ATOMIC_ACQUIRE))
+				return;
+			pthread_join(reload_thread, NULL);
+			if (reload_config)
+				reload_swap();
+			else
+				reload_state = RELOAD_IDLE;
+			break;
+		case RELOAD_RETIRING:
+			if (!wait && !__atomic_load_n(&reload_done, __ATOMIC_ACQUIRE))
+				return;
+			pthread_join(reload_thread, NULL);
+			reload_state = RELOAD_IDLE;
+			break;
+	}
+}
 
-	if (ret == 0)
-		return NULL;
+/* Complete any reload in progress, before exiting */
+void reload_finish(void)
+{
+	while (reload_state != RELOAD_IDLE)
+		reload_poll(1);
+}
+
+/* Returns the mask of the outputs the message goes to, all of them if no route is configured */
+static unsigned int route_event(const struct json_msg_type *m)
+{
+	route_t *r;
+	unsigned int outputs = 0;
 
-	return proc;
+	if (!config->routes)
+		return config->nr_outputs == MAX_OUTPUTS ? ~0U : (1U << config->nr_outputs) - 1;
+
+	for (r = config->routes; r; r = r->next) {
+		if (r->categories && !list_match(r->categories, m->category))
+			continue;
+		if (r->keys && !list_match(r->keys, m->key))
+			continue;
+		if (r->have_uid && (m->uid < r->uid_min || m->uid > r->uid_max))
+			continue;
+		if (r->have_auid && (m->auid < r->auid_min || m->auid > r->auid_max))
+			continue;
+		outputs |= r->outputs;
+	}
+	return outputs;
 }
 
-/* This creates the JSON message we'll send over by deserializing the C struct into a char array
+/* This creates the JSON message we'll send over by deserializing the C struct into a char array, and queues it to the
+ * outputs it's routed to.
  * the function name is rather historical, since this does not send to syslog anymore.
  */
 void syslog_json_msg(struct json_msg_type json_msg)
 {
 	attr_t *head = json_msg.details;
 	attr_t *prev;
+	output_t *o;
+	msg_t *m;
 	char msg[MAX_JSON_MSG_SIZE];
-	int len;
+	char gelf[MAX_JSON_MSG_SIZE];
+	const char *sep = "";
+	int len, glen = 0, refs = 0;
+	unsigned int outputs;
+
+	outputs = route_event(&json_msg);
+	if (!outputs) {
+		json_del_attrs(json_msg.details);
+		return;
+	}
+
+	/* the summary, truncated to MAX_SUMMARY_LEN, must not end halfway through an escape */
+	if (json_msg.summary)
+		escape_trim(json_msg.summary);
+
+	/* GELF flavor of the same message for the HTTP outputs */
+	if (outputs & config->http_outputs)
+		glen = snprintf(gelf, MAX_JSON_MSG_SIZE,
+"{\"version\":\"1.1\",\"host\":\"%s\",\"short_message\":\"%s\",\"timestamp\":%ld.%03u,\
+\"_audit_category\":\"%s\",\"_audit_plugin\":\"%s\",\"_audit_version\":\"%s\"",
+			json_msg.hostname, json_msg.summary, (long)json_msg.time, json_msg.milli,
+			json_msg.category, PROGRAM_NAME, STR(PROGRAM_VERSION));
 
 	len = snprintf(msg, MAX_JSON_MSG_SIZE,
 "{\"audit_category\":\"%s\",\"audit_summary\":\"%s\",\"audit_hostname\":\"%s\",\
@@ -499,17 +3838,61 @@ void syslog_json_msg(struct json_msg_type json_msg)
 		json_msg.timestamp, PROGRAM_NAME, STR(PROGRAM_VERSION));
 
 	while (head) {
-		len += snprintf(msg+len, MAX_JSON_MSG_SIZE-len, "%s,", head->value);
+		/* only whole attributes, leaving room for the closing "}}", so that the message stays valid JSON */
+		if (len + strlen(sep) + strlen(head->value) + 2 < MAX_JSON_MSG_SIZE) {
+			len += snprintf(msg+len, MAX_JSON_MSG_SIZE-len, "%s%s", sep, head->value);
+			sep = ",";
+		}
+		/* head->value is "name":"value" */
+		if (glen && glen < MAX_JSON_MSG_SIZE)
+			glen += snprintf(gelf+glen, MAX_JSON_MSG_SIZE-glen, ",\"_audit_%s", head->value+1);
 		prev = head;
 		head = head->next;
 		free(prev);
-		if (head == NULL)
-		    len--;
 	}
 	len += snprintf(msg+len, MAX_JSON_MSG_SIZE-len, "}}");
-	msg[MAX_JSON_MSG_SIZE-1] = '\0';
+	if (glen && glen < MAX_JSON_MSG_SIZE-1) {
+		glen += snprintf(gelf+glen, MAX_JSON_MSG_SIZE-glen, "}");
+	} else if (glen) {
+		syslog(LOG_ERR, "GELF message too long, message lost for the HTTP outputs!");
+		outputs &= ~config->http_outputs;
+		glen = 0;
+	}
+	TRACE(serialized, json_msg.serial, json_msg.category, len);
+	/* only routed to HTTP outputs, which could not take it */
+	if (!outputs)
+		return;
 
-	syslog(LOG_INFO, "%s", msg);
+	/* one allocation for the message and both of its flavors */
+	m = malloc(sizeof(msg_t) + len+1 + (glen ? glen+1 : 0));
+	if (!m) {
+		syslog(LOG_ERR, "syslog_json_msg() malloc failed, message lost!");
+		return;
+	}
+	m->val = (char *)(m+1);
+	memcpy(m->val, msg, len+1);
+	m->len = len;
+	m->gelf = NULL;
+	m->gelf_len = 0;
+	if (glen) {
+		m->gelf = m->val + len+1;
+		memcpy(m->gelf, gelf, glen+1);
+		m->gelf_len = glen;
+	}
+	m->serial = json_msg.serial;
+	m->time = json_msg.time;
+	m->after = handled_last;
+
+	for (o = config->outputs; o; o = o->next) {
+		if (outputs & (1U << o->id))
+			refs++;
+	}
+	m->refs = refs;
+	for (o = config->outputs; o; o = o->next) {
+		if (outputs & (1U << o->id))
+			output_enqueue(o, m);
+	}
+	TRACE(event_done, json_msg.serial, json_msg.category, len);
 }
 
 /* The main event handling, parsing function */
@@ -524,6 +3907,12 @@ static void handle_event(auparse_state_t *au,
 		.summary	= NULL,
 		.hostname	= hostname,
 		.timestamp	= NULL,
+		.time		= 0,
+		.milli		= 0,
+		.serial		= 0,
+		.key		= NULL,
+		.uid		= -1,
+		.auid		= -1,
 		.details	= NULL,
 	};
 
@@ -546,7 +3935,16 @@ static void handle_event(auparse_state_t *au,
 	const char *sys;
 	const char *syscall = NULL;
 	char fullcmd[MAX_ARG_LEN+1] = "\0";
+	char proctitle[MAX_ARG_LEN+1];
+	char cwdbuf[PATH_MAX], pathbuf[PATH_MAX], exebuf[PATH_MAX], commbuf[PROC_COMM_LEN*2];
 	char serial[64] = "\0";
+	char lineage[PROC_LINEAGE_LEN] = "\0";
+	const char *exe = NULL, *comm = NULL;
+	int pid = -1, ppid = -1, auid = -1, ses = -1, exitval = 0;
+	int login_ses = -1, login_auid = -1, login_pid = -1;
+	int logout_ses = -1, logout_pid = -1;
+	int havesyscall = 0;
+	proc_op_t proc_op = PROC_OP_NONE;
 	time_t t;
 	struct tm *tmp;
 
@@ -560,6 +3958,7 @@ static void handle_event(auparse_state_t *au,
 	if (cb_event_type != AUPARSE_CB_EVENT_READY) {
 		return;
 	}
+	TRACE(event_start);
 
 	json_msg.timestamp = (char *)alloca(TS_LEN);
 	json_msg.summary = (char *)alloca(MAX_SUMMARY_LEN);
@@ -579,7 +3978,10 @@ static void handle_event(auparse_state_t *au,
 		t = auparse_get_time(au);
 		tmp = localtime(&t);
 		strftime(json_msg.timestamp, TS_LEN, "%FT%T%z", tmp);
-		snprintf(serial, TS_LEN-1, "%lu", auparse_get_serial(au));
+		json_msg.time = t;
+		json_msg.milli = auparse_get_milli(au);
+		json_msg.serial = auparse_get_serial(au);
+		snprintf(serial, TS_LEN-1, "%lu", json_msg.serial);
 		json_msg.details = json_add_attr(json_msg.details, "serial", serial);
 
 		switch (type) {
@@ -601,6 +4003,7 @@ static void handle_event(auparse_state_t *au,
 				json_msg.details = json_add_attr(json_msg.details, "old_promiscuous", auparse_find_field(au, "old_prom"));
 				goto_record_type(au, type);
 				if (auparse_find_field(au, "auid")) {
+					json_msg.auid = auparse_get_field_int(au);
 					json_msg.details = json_add_attr_free(json_msg.details, "originaluser",
 														get_username(auparse_get_field_int(au)));
 
@@ -609,6 +4012,7 @@ static void handle_event(auparse_state_t *au,
 				goto_record_type(au, type);
 
 				if (auparse_find_field(au, "uid")) {
+					json_msg.uid = auparse_get_field_int(au);
 					json_msg.details = json_add_attr_free(json_msg.details, "user", get_username(auparse_get_field_int(au)));
 					json_msg.details = json_add_attr(json_msg.details, "uid", auparse_get_field_str(au));
 				}
@@ -646,13 +4050,13 @@ static void handle_event(auparse_state_t *au,
 
 				if (auparse_find_field(au, "parent"))
 					json_msg.details = json_add_attr(json_msg.details, "parentprocess",
-														get_proc_name(auparse_get_field_int(au)));
+														proc_table_name(auparse_get_field_int(au)));
 
 				goto_record_type(au, type);
 
 				if (auparse_find_field(au, "pid"))
 					json_msg.details = json_add_attr(json_msg.details, "processname",
-														get_proc_name(auparse_get_field_int(au)));
+														proc_table_name(auparse_get_field_int(au)));
 				goto_record_type(au, type);
 
 				json_msg.details = json_add_attr(json_msg.details, "aaerror", auparse_find_field(au, "error"));
@@ -673,34 +4077,36 @@ static void handle_event(auparse_state_t *au,
 					argcount = 0;
 				fullcmd[0] = '\0';
 				len = 0;
-				for (i = 0; i != argcount; i++) {
+				for (i = 0; i != argcount && len < MAX_ARG_LEN; i++) {
 					goto_record_type(au, type);
 					tmplen = snprintf(f, 7, "a%d", i);
 					f[tmplen] = '\0';
 					cmd = auparse_find_field(au, f);
-					cmd = auparse_interpret_field(au);
 					if (!cmd)
 						continue;
-					if (MAX_ARG_LEN-strlen(fullcmd) > strlen(cmd)) {
-						if (len == 0)
-							len += sprintf(fullcmd+len, "%s", cmd);
-						else
-							len += sprintf(fullcmd+len, " %s", cmd);
-					}
+					if (len > 0)
+						fullcmd[len++] = ' ';
+					/* decoded in place, the last argument is truncated if it doesn't fit */
+					len += field_decode(fullcmd+len, sizeof(fullcmd)-len, cmd, ' ');
 				}
 				json_msg.details = json_add_attr(json_msg.details, "command", fullcmd);
 				break;
 
 			case AUDIT_CWD:
-				cwd = auparse_find_field(au, "cwd");
-				if (cwd) {
-					auparse_interpret_field(au);
-					json_msg.details = json_add_attr(json_msg.details, "cwd", auparse_find_field(au, "cwd"));
+				if (field_decode(cwdbuf, sizeof(cwdbuf), auparse_find_field(au, "cwd"), ' ') >= 0) {
+					cwd = cwdbuf;
+					json_msg.details = json_add_attr(json_msg.details, "cwd", cwd);
 				}
 				break;
 
+			case AUDIT_PROCTITLE:
+				if (field_decode(proctitle, sizeof(proctitle), auparse_find_field(au, "proctitle"), ' ') > 0)
+					json_msg.details = json_add_attr(json_msg.details, "proctitle", proctitle);
+				break;
+
 			case AUDIT_PATH:
-				path = auparse_find_field(au, "name");
+				if (field_decode(pathbuf, sizeof(pathbuf), auparse_find_field(au, "name"), ' ') >= 0)
+					path = pathbuf;
 				json_msg.details = json_add_attr(json_msg.details, "path", path);
 				goto_record_type(au, type);
 				json_msg.details = json_add_attr(json_msg.details, "inode", auparse_find_field(au, "inode"));
@@ -731,7 +4137,10 @@ static void handle_event(auparse_state_t *au,
 					return;
 				}
 
-				json_msg.details = json_add_attr(json_msg.details, "processname", auparse_find_field(au, "comm"));
+				havesyscall = 1;
+				if (field_decode(commbuf, sizeof(commbuf), auparse_find_field(au, "comm"), ' ') >= 0)
+					comm = commbuf;
+				json_msg.details = json_add_attr(json_msg.details, "processname", comm);
 				goto_record_type(au, type);
 
 				if (!strncmp(sys, "write", 5) || !strncmp(sys, "open", 4) || !strncmp(sys, "unlink", 6) || !strncmp(sys,
@@ -757,20 +4166,30 @@ static void handle_event(auparse_state_t *au,
 					category = CAT_PROMISC;
 				} else if (!strncmp(sys, "adjtimex", 8)) {
 					category = CAT_TIME;
+				} else if (!strncmp(sys, "clone", 5) || !strncmp(sys, "fork", 4) || !strncmp(sys, "vfork", 5)) {
+					/* only used to maintain the process table */
+					proc_op = PROC_OP_FORK;
+				} else if (!strncmp(sys, "exit", 4)) {
+					proc_op = PROC_OP_EXIT;
 				} else {
 					syslog(LOG_INFO, "System call %u %s is not supported by %s", i, sys, PROGRAM_NAME);
 				}
 
-				json_msg.details = json_add_attr(json_msg.details, "auditkey", auparse_find_field(au, "key"));
+				json_msg.key = auparse_find_field(au, "key");
+				json_msg.details = json_add_attr(json_msg.details, "auditkey", json_msg.key);
 				goto_record_type(au, type);
 
 				if (auparse_find_field(au, "ppid"))
-					json_msg.details = json_add_attr(json_msg.details, "parentprocess",
-														get_proc_name(auparse_get_field_int(au)));
+					ppid = auparse_get_field_int(au);
+				goto_record_type(au, type);
 
+				if (auparse_find_field(au, "exit"))
+					exitval = auparse_get_field_int(au);
 				goto_record_type(au, type);
 
 				if (auparse_find_field(au, "auid")) {
+					auid = auparse_get_field_int(au);
+					json_msg.auid = auid;
 					json_msg.details = json_add_attr_free(json_msg.details, "originaluser",
 														get_username(auparse_get_field_int(au)));
 
@@ -779,6 +4198,7 @@ static void handle_event(auparse_state_t *au,
 				goto_record_type(au, type);
 
 				if (auparse_find_field(au, "uid")) {
+					json_msg.uid = auparse_get_field_int(au);
 					json_msg.details = json_add_attr_free(json_msg.details, "user", get_username(auparse_get_field_int(au)));
 					json_msg.details = json_add_attr(json_msg.details, "uid", auparse_get_field_str(au));
 				}
@@ -786,11 +4206,16 @@ static void handle_event(auparse_state_t *au,
 
 				json_msg.details = json_add_attr(json_msg.details, "tty", auparse_find_field(au, "tty"));
 				goto_record_type(au, type);
-				json_msg.details = json_add_attr(json_msg.details, "process", auparse_find_field(au, "exe"));
+				if (field_decode(exebuf, sizeof(exebuf), auparse_find_field(au, "exe"), ' ') >= 0)
+					exe = exebuf;
+				json_msg.details = json_add_attr(json_msg.details, "process", exe);
 				goto_record_type(au, type);
 				json_msg.details = json_add_attr(json_msg.details, "ppid", auparse_find_field(au, "ppid"));
 				goto_record_type(au, type);
-				json_msg.details = json_add_attr(json_msg.details, "pid", auparse_find_field(au, "pid"));
+				if (auparse_find_field(au, "pid")) {
+					pid = auparse_get_field_int(au);
+					json_msg.details = json_add_attr(json_msg.details, "pid", auparse_get_field_str(au));
+				}
 				goto_record_type(au, type);
 				json_msg.details = json_add_attr(json_msg.details, "gid", auparse_find_field(au, "gid"));
 				goto_record_type(au, type);
@@ -806,8 +4231,38 @@ static void handle_event(auparse_state_t *au,
 				goto_record_type(au, type);
 				json_msg.details = json_add_attr(json_msg.details, "fsgid", auparse_find_field(au, "fsgid"));
 				goto_record_type(au, type);
-				json_msg.details = json_add_attr(json_msg.details, "session", auparse_find_field(au, "ses"));
+				if (auparse_find_field(au, "ses")) {
+					ses = auparse_get_field_int(au);
+					json_msg.details = json_add_attr(json_msg.details, "session", auparse_get_field_str(au));
+				}
+				goto_record_type(au, type);
+				break;
+
+			case AUDIT_LOGIN:
+				if (config->session_tracking == SESSION_OFF || !auparse_find_field(au, "ses"))
+					break;
+				login_ses = auparse_get_field_int(au);
 				goto_record_type(au, type);
+				if (auparse_find_field(au, "auid"))
+					login_auid = auparse_get_field_int(au);
+				goto_record_type(au, type);
+				if (auparse_find_field(au, "pid"))
+					login_pid = auparse_get_field_int(au);
+				break;
+
+			case AUDIT_USER_END:
+			case AUDIT_USER_LOGOUT:
+				if (config->session_tracking == SESSION_OFF || !auparse_find_field(au, "ses"))
+					break;
+				logout_ses = auparse_get_field_int(au);
+				/* USER_END only ends the session if it comes from the process which logged in */
+				if (type == AUDIT_USER_END) {
+					goto_record_type(au, type);
+					if (auparse_find_field(au, "pid"))
+						logout_pid = auparse_get_field_int(au);
+					else
+						logout_ses = -1;
+				}
 				break;
 
 			default:
@@ -816,6 +4271,17 @@ static void handle_event(auparse_state_t *au,
 		num++;
 	}
 
+	if (havesyscall)
+		proc_table_update(proc_op, pid, ppid, exe, comm, auid, ses, exitval);
+
+	if (config->session_tracking != SESSION_OFF) {
+		if (login_ses != -1)
+			session_login(login_ses, login_auid, login_pid, json_msg.time);
+		if (logout_ses != -1)
+			session_end(logout_ses, logout_pid);
+		session_expire(json_msg.time);
+	}
+
 	if (!havejson) {
 		json_del_attrs(json_msg.details);
 		return;
@@ -893,6 +4359,23 @@ static void handle_event(auparse_state_t *au,
 					unescape(dev), promisc ? "on": "off");
 	}
 
+	/* in "only" mode, the commands and writes of tracked sessions are only sent in the session summary */
+	if (config->session_tracking != SESSION_OFF &&
+			session_record(ses, auid, json_msg.time, category == CAT_EXECVE ? fullcmd : NULL,
+				category == CAT_WRITE ? path : NULL, cwd) &&
+			config->session_tracking == SESSION_ONLY) {
+		json_del_attrs(json_msg.details);
+		return;
+	}
+
+	if (ppid > 0) {
+		json_msg.details = json_add_attr(json_msg.details, "parentprocess", proc_table_name(ppid));
+		json_msg.details = json_add_attr(json_msg.details, "ancestry",
+											proc_table_lineage(ppid, lineage, sizeof(lineage)));
+	}
+
+	TRACE(event_ready, json_msg.serial, json_msg.category);
+
 	/* syslog_json_msg() also frees json_msg.details when called. */
 	syslog_json_msg(json_msg);
 }
@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# GELF over HTTP output against a loopback server: keep-alive reuse, pipelining, and a request only partly written
+# (the server stops reading, then resets the connection) followed by a reconnect.
+# Usage: tests/http_loopback.py ./audisp-graylog
+
+import json
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+EVENTS = 400
+# more than the 4 MB a loopback socket can buffer (tcp_wmem), so that the write blocks
+STALLED_EVENTS = 2000
+REPLY = b"HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\n\r\n"
+
+
+def audit_events(first, count, arglen):
+    lines = []
+    for i in range(first, first + count):
+        stamp = "msg=audit(1700000000.%03d:%d):" % (i % 1000, i)
+        lines.append("type=SYSCALL %s arch=c000003e syscall=59 success=yes exit=0 items=1 ppid=1 pid=%d auid=1000 "
+                     "uid=1000 gid=1000 euid=1000 suid=1000 fsuid=1000 egid=1000 sgid=1000 fsgid=1000 tty=pts0 ses=3 "
+                     "comm=\"ls\" exe=\"/usr/bin/ls\" key=(null)" % (stamp, 10000 + i))
+        lines.append("type=EXECVE %s argc=2 a0=\"ls\" a1=\"%s\"" % (stamp, "f" * arglen))
+        lines.append("type=EOE %s" % stamp)
+    return ("\n".join(lines) + "\n").encode()
+
+
+class Server(threading.Thread):
+    """Minimal GELF HTTP input
+    stall: on the first connection, answer the first request late so that the queue fills up, then only read this many
+    bytes of the next (large) request, stop reading and reset the connection.
+    delay: wait before reading what follows a request, so that pipelined requests pile up.
+    """
+
+    def __init__(self, stall=0, delay=0.0):
+        super().__init__(daemon=True)
+        self.sock = socket.socket()
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        self.sock.bind(("127.0.0.1", 0))
+        self.sock.listen(4)
+        self.port = self.sock.getsockname()[1]
+        self.stall = stall
+        self.delay = delay
+        self.lock = threading.Lock()
+        self.serials = {}
+        self.connections = 0
+        self.requests = 0
+        self.max_pipelined = 0
+        self.errors = []
+
+    def run(self):
+        while True:
+            conn, _ = self.sock.accept()
+            with self.lock:
+                self.connections += 1
+                first = self.connections == 1
+            threading.Thread(target=self.serve, args=(conn, first), daemon=True).start()
+
+    def serve(self, conn, first):
+        if first and self.stall:
+            self.serve_stalled(conn)
+            return
+        buf = b""
+        while True:
+            data = conn.recv(1 << 20)
+            if not data:
+                conn.close()
+                return
+            buf += data
+            if self.delay:
+                # let the client write more requests before answering
+                time.sleep(self.delay)
+                conn.setblocking(False)
+                try:
+                    while True:
+                        data = conn.recv(1 << 20)
+                        if not data:
+                            break
+                        buf += data
+                except BlockingIOError:
+                    pass
+                conn.setblocking(True)
+            buf, complete = self.parse(buf)
+            with self.lock:
+                self.max_pipelined = max(self.max_pipelined, complete)
+            if complete:
+                conn.sendall(REPLY * complete)
+
+    def serve_stalled(self, conn):
+        buf = b""
+        complete = 0
+        while not complete:
+            buf += conn.recv(1 << 20)
+            buf, complete = self.parse(buf)
+        time.sleep(1)
+        conn.sendall(REPLY * complete)
+        received = len(buf)
+        while received < self.stall:
+            received += len(conn.recv(self.stall))
+        time.sleep(5)
+        conn.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+        conn.close()
+
+    def parse(self, buf):
+        """Record the complete requests of buf, returns what is left and their number"""
+        complete = 0
+        while b"\r\n\r\n" in buf:
+            head, rest = buf.split(b"\r\n\r\n", 1)
+            length = 0
+            for line in head.split(b"\r\n")[1:]:
+                name, _, value = line.partition(b":")
+                if name.strip().lower() == b"content-length":
+                    length = int(value)
+            if len(rest) < length:
+                break
+            self.record(head, rest[:length])
+            buf = rest[length:]
+            complete += 1
+        return buf, complete
+
+    def record(self, head, body):
+        with self.lock:
+            self.requests += 1
+            if not head.startswith(b"POST /gelf HTTP/1.1"):
+                self.errors.append("bad request line: %r" % head[:40])
+                return
+            for line in body.split(b"\n"):
+                if not line:
+                    continue
+                try:
+                    msg = json.loads(line)
+                except ValueError:
+                    self.errors.append("invalid GELF: %r" % line[:60])
+                    continue
+                serial = int(msg["_audit_serial"])
+                self.serials[serial] = self.serials.get(serial, 0) + 1
+
+    def wait_for(self, count, timeout=30):
+        end = time.time() + timeout
+        while time.time() < end:
+            with self.lock:
+                if len(self.serials) >= count:
+                    return True
+            time.sleep(0.1)
+        return False
+
+
+def run(binary, server, settings, events, count):
+    with tempfile.TemporaryDirectory() as tmp:
+        conf = os.path.join(tmp, "audisp-graylog.conf")
+        with open(conf, "w") as f:
+            f.write("syslog_output = no\nhttp_host = 127.0.0.1\nhttp_port = %d\nhttp_compress = no\n"
+                    "http_retry_max_backoff = 1\n%s" % (server.port, settings))
+        proc = subprocess.Popen([binary, conf], stdin=subprocess.PIPE)
+        proc.stdin.write(events)
+        proc.stdin.flush()
+        delivered = server.wait_for(count)
+        proc.stdin.close()
+        ret = proc.wait(timeout=30)
+    return delivered, ret
+
+
+def check(name, ok, detail):
+    print("%s %s: %s" % ("ok" if ok else "FAIL", name, detail))
+    return ok
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else "./audisp-graylog"
+    ok = True
+
+    # keep-alive and pipelining: one connection, several requests written before their responses
+    server = Server(delay=0.2)
+    server.start()
+    delivered, ret = run(binary, server, "http_batch_size = 10\nhttp_pipeline = 4\n", audit_events(1, EVENTS, 8), EVENTS)
+    ok &= check("keep-alive", delivered and ret == 0 and server.connections == 1 and not server.errors,
+                "%d/%d events, %d requests, %d connection(s), exit %d %s" % (len(server.serials), EVENTS,
+                server.requests, server.connections, ret, server.errors[:1]))
+    ok &= check("pipelining", server.max_pipelined > 1,
+                "up to %d requests answered at once" % server.max_pipelined)
+    ok &= check("exactly once", all(n == 1 for n in server.serials.values()), "no duplicate")
+
+    # the server stops reading halfway through a large request and then resets the connection: the write times out,
+    # the connection must be dropped and the batch sent again on a new one, without killing the plugin
+    server = Server(stall=65536)
+    server.start()
+    delivered, ret = run(binary, server, "http_batch_size = %d\nhttp_pipeline = 1\nhttp_timeout = 2\n" % STALLED_EVENTS,
+                         audit_events(1, STALLED_EVENTS, 2000), STALLED_EVENTS)
+    ok &= check("partial write", delivered and ret == 0 and server.connections >= 2 and not server.errors,
+                "%d/%d events, %d connection(s), exit %d %s" % (len(server.serials), STALLED_EVENTS,
+                server.connections, ret, server.errors[:1]))
+
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()